@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+/**
+ * A read-only array whose elements are either its own, moved in from the
+ * vector they were built in, or someone else's, like a section of a mapped
+ * snapshot.  Either way it reads the same, so the indexes that use it can be
+ * built in memory or used straight out of a file without copying.
+ *
+ * A copy of an owning array owns a copy of the elements, a copy of a view is
+ * another view of the same ones.
+ **/
+template <typename T> class Array {
+  public:
+    Array() : data_(nullptr), size_(0) {}
+
+    explicit Array(std::vector<T> elements) : owned(std::move(elements)), data_(owned.data()), size_(owned.size()) {}
+
+    // Elements owned elsewhere, which must outlive the array
+    static Array view(const T *data, const std::size_t size)
+    {
+        Array array;
+        array.data_ = data;
+        array.size_ = size;
+        return array;
+    }
+
+    Array(const Array &other) : owned(other.owned), data_(other.owns() ? owned.data() : other.data_), size_(other.size_) {}
+
+    // Moving a vector keeps its elements where they are, so data_ stays good
+    Array(Array &&other) noexcept : owned(std::move(other.owned)), data_(other.data_), size_(other.size_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    Array &operator=(Array other) noexcept
+    {
+        owned.swap(other.owned);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    const T *data() const { return data_; }
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T &operator[](const std::size_t i) const { return data_[i]; }
+    const T &front() const { return data_[0]; }
+    const T &back() const { return data_[size_ - 1]; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+
+    // Bytes of elements, whether on our heap or in a mapping
+    std::size_t bytes() const { return size_ * sizeof(T); }
+
+  private:
+    bool owns() const { return !owned.empty() && data_ == owned.data(); }
+
+    std::vector<T> owned;
+    const T *data_;
+    std::size_t size_;
+};
+
+}
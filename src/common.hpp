@@ -1,17 +1,52 @@
 #pragma once
 
 #include <boost/geometry.hpp>
-#include <boost/geometry/index/rtree.hpp>
+#include <algorithm>
 #include <utility>
 #include <cstdint>
 
-typedef boost::geometry::model::point<double, 3, boost::geometry::cs::spherical_equatorial<boost::geometry::degree>> wgs84_point_t;
-typedef boost::geometry::model::segment<wgs84_point_t> wgs84_segment_t;
-typedef boost::geometry::model::linestring<wgs84_point_t> wgs84_linestring_t;
-typedef boost::geometry::model::box<wgs84_point_t> wgs84_box_t;
 typedef std::pair<std::uint64_t, std::uint64_t> nodepair_t;
-typedef std::pair<wgs84_segment_t, nodepair_t> rtree_value_t;
-typedef boost::geometry::index::rtree<rtree_value_t, boost::geometry::index::rstar<16>> line_rtree_t;
+// Dense index of an edge (a pair of consecutive way nodes), in load order
+typedef std::uint32_t edge_id_t;
+
+// Integer world coordinates, see util::web_mercator::WORLD_BITS
+typedef boost::geometry::model::point<std::uint32_t, 2, boost::geometry::cs::cartesian> world_point_t;
+typedef boost::geometry::model::box<world_point_t> world_box_t;
+
+/**
+ * A run of consecutive segments of one way, stored and indexed as a unit.
+ * Its points are projected to world coordinates at load time and stored out
+ * of line: segment i of the chunk runs from point first_point + i to
+ * first_point + i + 1.  Segments get consecutive edge ids, so segment i is
+ * edge first_edge + i, and the OSM node ids are kept out of line too,
+ * indexed by edge, as they're only needed to join speed data.
+ *
+ * Ways are cut into chunks of at most MAX_POINTS points so each chunk's
+ * bounding box stays reasonably tight.
+ **/
+struct chunk_t {
+    static const constexpr std::uint32_t MAX_POINTS = 32;
+
+    std::uint32_t min_x;
+    std::uint32_t min_y;
+    std::uint32_t max_x;
+    std::uint32_t max_y;
+    std::uint32_t first_point;
+    edge_id_t first_edge;
+    std::uint8_t num_points;
+    std::uint8_t minzoom;
+};
+
+struct chunk_indexable {
+    typedef world_box_t result_type;
+    world_box_t operator()(const chunk_t &chunk) const {
+        return world_box_t({chunk.min_x, chunk.min_y}, {chunk.max_x, chunk.max_y});
+    }
+};
+
+struct chunk_minzoom {
+    std::uint8_t operator()(const chunk_t &chunk) const { return chunk.minzoom; }
+};
 
 enum ValidDirections {
     Both,
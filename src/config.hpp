@@ -0,0 +1,262 @@
+#pragma once
+
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+#include "road_classes.hpp"
+#include "speed_bins.hpp"
+#include "tile.hpp"
+
+namespace util { namespace config {
+
+// One key of a config file, with the keys it's nested under first
+struct entry_t {
+    std::vector<std::string> path;
+    // Empty for a key with nested keys, or none
+    std::string value;
+    std::size_t line;
+};
+
+namespace detail {
+inline std::string trim(const std::string &text)
+{
+    const auto first = text.find_first_not_of(" \t\r");
+    if (first == std::string::npos) return std::string();
+    return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+}
+
+inline std::string unquote(const std::string &text)
+{
+    if (text.size() >= 2 && (text.front() == '"' || text.front() == '\'') && text.back() == text.front()) return text.substr(1, text.size() - 2);
+    return text;
+}
+
+// Cuts a comment off the end of a line: a # at its start or after a space,
+// outside quotes
+inline std::string stripComment(const std::string &line)
+{
+    char quote = 0;
+    for (std::size_t i = 0; i < line.size(); ++i)
+    {
+        const char c = line[i];
+        if (quote != 0)
+        {
+            if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+        }
+        else if (c == '#' && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t'))
+        {
+            return line.substr(0, i);
+        }
+    }
+    return line;
+}
+}
+
+/**
+ * Parses the subset of YAML that config files use: nested mappings in
+ * block style, with `key: value` or `key:` and more deeply indented keys
+ * under it, and # comments.  Keys may have spaces in them, and values may
+ * be quoted.  The result lists every key in file order, so the order of
+ * things like speed bins is kept.  Errors name the line they're on.
+ **/
+inline std::vector<entry_t> parse(const std::string &text, const std::string &name)
+{
+    const auto fail = [&name](const std::size_t line, const std::string &message) {
+        throw std::runtime_error(name + ":" + std::to_string(line) + ": " + message);
+    };
+
+    std::vector<entry_t> entries;
+    // The keys the current line could be nested under, with their indents
+    std::vector<std::pair<std::size_t, std::string>> parents;
+    // Only a line after a key without a value can be indented further
+    std::size_t last_indent = 0;
+    bool expect_nested = false;
+
+    std::istringstream lines(text);
+    std::string raw;
+    for (std::size_t number = 1; std::getline(lines, raw); ++number)
+    {
+        const auto line = detail::stripComment(raw);
+        if (detail::trim(line).empty()) continue;
+        const auto indent = line.find_first_not_of(' ');
+        if (line[indent] == '\t') fail(number, "tabs can't be used to indent");
+        if (line[indent] == '-') fail(number, "lists aren't supported, use keys");
+
+        if (indent > last_indent && !expect_nested) fail(number, "unexpected indent");
+        while (!parents.empty() && parents.back().first >= indent) parents.pop_back();
+        last_indent = indent;
+        expect_nested = false;
+
+        const auto colon = line.find(": ", indent);
+        const bool ends_with_colon = detail::trim(line).back() == ':';
+        if (colon == std::string::npos && !ends_with_colon) fail(number, "expected key: value");
+        const auto key_end = colon == std::string::npos ? line.find_last_of(':') : colon;
+        const auto key = detail::unquote(detail::trim(line.substr(indent, key_end - indent)));
+        if (key.empty()) fail(number, "missing key");
+        const auto value = colon == std::string::npos ? std::string() : detail::unquote(detail::trim(line.substr(colon + 2)));
+
+        entry_t entry;
+        for (const auto &parent : parents) entry.path.push_back(parent.second);
+        entry.path.push_back(key);
+        entry.value = value;
+        entry.line = number;
+        for (const auto &other : entries)
+        {
+            if (other.path == entry.path) fail(number, "duplicate key " + key);
+        }
+        entries.push_back(entry);
+
+        if (value.empty())
+        {
+            parents.emplace_back(indent, key);
+            expect_nested = true;
+        }
+    }
+    return entries;
+}
+
+/**
+ * What can be configured, with the built in defaults for anything a config
+ * file leaves out.
+ *
+ *   roads:               # highway tag values to load, replacing the defaults
+ *     motorway:
+ *       minzoom: 4       # the lowest zoom it's drawn at
+ *       oneway: yes      # without a oneway tag: no (both ways), yes or -1
+ *   speed_bins:          # least to most congested, replacing the defaults
+ *     uncongested: 0.75  # the lowest current/free flow speed in the bin
+ *   metatile_size: 2     # tiles are rendered in blocks this wide: 1, 2, 4 or 8
+ *
+ * Road classes are used while a map is loaded, so a snapshot keeps the ones
+ * it was built with.
+ **/
+struct Config {
+    static const constexpr int MAX_METATILE_SIZE = 8;
+
+    RoadClasses road_classes = RoadClasses::defaults();
+    speeds::SpeedBins speed_bins = speeds::SpeedBins::defaults();
+    // Tiles across the block a tile that isn't cached is rendered with, a
+    // power of two so blocks are aligned within every zoom
+    int metatile_size = 2;
+
+    static Config parse(const std::string &text, const std::string &name)
+    {
+        const auto fail = [&name](const entry_t &entry, const std::string &message) {
+            throw std::runtime_error(name + ":" + std::to_string(entry.line) + ": " + message);
+        };
+        const auto number = [&fail](const entry_t &entry, const double min, const double max) {
+            char *end = nullptr;
+            errno = 0;
+            const double result = std::strtod(entry.value.c_str(), &end);
+            if (entry.value.empty() || *end != '\0' || errno != 0 || result < min || result > max)
+            {
+                std::ostringstream message;
+                message << entry.path.back() << " should be a number from " << min << " to " << max;
+                fail(entry, message.str());
+            }
+            return result;
+        };
+
+        Config config;
+        std::vector<road_class_t> roads;
+        std::vector<std::pair<std::string, double>> bins;
+        bool has_roads = false;
+        bool has_bins = false;
+        for (const auto &entry : config::parse(text, name))
+        {
+            const auto &path = entry.path;
+            if (path[0] == "roads")
+            {
+                has_roads = true;
+                if (path.size() == 1) continue;
+                if (path.size() == 2)
+                {
+                    if (!entry.value.empty()) fail(entry, "a road class needs at least a minzoom under it");
+                    roads.push_back({path[1], NO_MINZOOM, Both});
+                }
+                else if (path.size() == 3 && path[2] == "minzoom")
+                {
+                    roads.back().minzoom = static_cast<std::uint8_t>(number(entry, 0, util::tile::MAX_ZOOM));
+                }
+                else if (path.size() == 3 && path[2] == "oneway")
+                {
+                    if (entry.value == "no") roads.back().directions = Both;
+                    else if (entry.value == "yes") roads.back().directions = Forward;
+                    else if (entry.value == "-1") roads.back().directions = Reverse;
+                    else fail(entry, "oneway should be no, yes or -1");
+                }
+                else
+                {
+                    fail(entry, "unknown road class setting " + path.back());
+                }
+            }
+            else if (path[0] == "speed_bins")
+            {
+                has_bins = true;
+                if (path.size() == 1) continue;
+                if (path.size() != 2) fail(entry, "a speed bin is just a name and a ratio");
+                bins.emplace_back(path[1], number(entry, 0, 1));
+            }
+            else if (path[0] == "metatile_size")
+            {
+                if (path.size() != 1) fail(entry, "metatile_size is just a number");
+                const auto size = number(entry, 1, MAX_METATILE_SIZE);
+                // Blocks of any other size would straddle the edge of the
+                // world at some zoom
+                const int whole = static_cast<int>(size);
+                if (size != whole || (whole & (whole - 1)) != 0) fail(entry, "metatile_size should be 1, 2, 4 or 8");
+                config.metatile_size = whole;
+            }
+            else
+            {
+                fail(entry, "unknown setting " + path[0]);
+            }
+        }
+
+        try
+        {
+            if (has_roads)
+            {
+                for (const auto &road : roads)
+                {
+                    if (road.minzoom == NO_MINZOOM) throw std::invalid_argument("road class " + road.name + " has no minzoom");
+                }
+                config.road_classes = RoadClasses(std::move(roads));
+            }
+            if (has_bins) config.speed_bins = speeds::SpeedBins(bins);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            throw std::runtime_error(name + ": " + e.what());
+        }
+        return config;
+    }
+
+    static Config load(const std::string &path)
+    {
+        std::ifstream file(path);
+        if (!file) throw std::runtime_error(path + ": " + std::strerror(errno));
+        std::ostringstream text;
+        text << file.rdbuf();
+        return parse(text.str(), path);
+    }
+
+  private:
+    static const constexpr std::uint8_t NO_MINZOOM = 255;
+};
+
+} }
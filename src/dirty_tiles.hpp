@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+#include "tile.hpp"
+#include "vector_tile.hpp"
+#include "web_mercator.hpp"
+
+namespace util { namespace tile {
+
+/**
+ * A set of tiles at every zoom, built from the segments drawn on them.
+ *
+ * Only the cells of the deepest zoom that each segment passes through are
+ * kept, once however many zooms the segment is drawn at.  A segment's cells
+ * are a cover of the segment, not of its bounding box, so a long diagonal
+ * one marks a band of cells rather than a rectangle: it's halved until each
+ * piece's box is at most two cells across one way.
+ *
+ * The tiles at a zoom are derived from the cells when they're asked for:
+ * shifting a cell's box, widened by the buffer around tiles at that zoom,
+ * gives the tiles it can be drawn on.  Each cell is kept as its segment's
+ * minzoom << 48 | x << 24 | y, sorted and without repeats once finish() has
+ * been called, so the cells drawn at a zoom come first.
+ **/
+class DirtyTiles {
+  public:
+    // The zoom of the cells, which no tile is deeper than
+    static const constexpr int CELL_ZOOM = MAX_ZOOM;
+
+    void addSegment(const world_point_t &a, const world_point_t &b, const int minzoom)
+    {
+        if (minzoom > MAX_ZOOM) return;
+        cover(a.get<0>(), a.get<1>(), b.get<0>(), b.get<1>(), static_cast<std::uint64_t>(std::max(0, minzoom)) << 48);
+    }
+
+    // Sorts the cells and drops repeats
+    void finish()
+    {
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        cells.shrink_to_fit();
+    }
+
+    // The tiles at zoom z, as x << 32 | y, sorted and without repeats
+    std::vector<std::uint64_t> tiles(const int z) const
+    {
+        std::vector<std::uint64_t> result;
+        const auto shift = util::web_mercator::WORLD_BITS - z;
+        const std::int64_t tile_size = std::int64_t{1} << shift;
+        const std::int64_t buffer = static_cast<std::int64_t>(tile_size * (util::vector_tile::BUFFER / util::vector_tile::EXTENT));
+        const std::int64_t max_tile = (std::int64_t{1} << z) - 1;
+
+        // Neighbouring cells mostly give the same tiles, so a range is only
+        // added when it differs from the last
+        std::int64_t last_min_x = -1, last_max_x = -1, last_min_y = -1, last_max_y = -1;
+        const auto drawn = std::upper_bound(cells.begin(), cells.end(), (static_cast<std::uint64_t>(z) << 48) | 0xffffffffffffull);
+        for (auto cell = cells.begin(); cell != drawn; ++cell)
+        {
+            const std::int64_t cell_x = static_cast<std::int64_t>((*cell >> 24) & 0xffffff) << CELL_SHIFT;
+            const std::int64_t cell_y = static_cast<std::int64_t>(*cell & 0xffffff) << CELL_SHIFT;
+            const auto min_x = std::max<std::int64_t>(0, (cell_x - buffer) >> shift);
+            const auto max_x = std::min(max_tile, (cell_x + CELL_SIZE - 1 + buffer) >> shift);
+            const auto min_y = std::max<std::int64_t>(0, (cell_y - buffer) >> shift);
+            const auto max_y = std::min(max_tile, (cell_y + CELL_SIZE - 1 + buffer) >> shift);
+            if (min_x == last_min_x && max_x == last_max_x && min_y == last_min_y && max_y == last_max_y) continue;
+            last_min_x = min_x;
+            last_max_x = max_x;
+            last_min_y = min_y;
+            last_max_y = max_y;
+
+            for (auto x = min_x; x <= max_x; ++x)
+            {
+                for (auto y = min_y; y <= max_y; ++y) result.push_back(static_cast<std::uint64_t>(x) << 32 | static_cast<std::uint64_t>(y));
+            }
+        }
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+    // Calls f(x, y, z) for each tile at every zoom
+    template <typename F> void forEach(F f) const
+    {
+        for (int z = 0; z <= MAX_ZOOM; ++z)
+        {
+            for (const auto key : tiles(z)) f(static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffff), z);
+        }
+    }
+
+    // Cells, not tiles, which would need deriving
+    std::size_t size() const { return cells.size(); }
+    std::size_t memory() const { return sizeof(*this) + cells.capacity() * sizeof(std::uint64_t); }
+
+  private:
+    static const constexpr unsigned CELL_SHIFT = util::web_mercator::WORLD_BITS - CELL_ZOOM;
+    static const constexpr std::int64_t CELL_SIZE = std::int64_t{1} << CELL_SHIFT;
+    static_assert(CELL_ZOOM <= 24, "cell coordinates are packed into 24 bits");
+
+    void cover(const std::int64_t ax, const std::int64_t ay, const std::int64_t bx, const std::int64_t by, const std::uint64_t minzoom)
+    {
+        const auto min_x = std::min(ax, bx) >> CELL_SHIFT;
+        const auto max_x = std::max(ax, bx) >> CELL_SHIFT;
+        const auto min_y = std::min(ay, by) >> CELL_SHIFT;
+        const auto max_y = std::max(ay, by) >> CELL_SHIFT;
+
+        if (max_x - min_x > 1 && max_y - min_y > 1)
+        {
+            const auto mid_x = (ax + bx) / 2;
+            const auto mid_y = (ay + by) / 2;
+            cover(ax, ay, mid_x, mid_y, minzoom);
+            cover(mid_x, mid_y, bx, by, minzoom);
+            return;
+        }
+
+        for (auto x = min_x; x <= max_x; ++x)
+        {
+            for (auto y = min_y; y <= max_y; ++y) cells.push_back(minzoom | static_cast<std::uint64_t>(x) << 24 | static_cast<std::uint64_t>(y));
+        }
+    }
+
+    std::vector<std::uint64_t> cells;
+};
+
+/**
+ * The tiles changed by the latest data updates, so a cache in front of the
+ * server can ask what changed since the generation it last saw.  Updates
+ * are kept, oldest forgotten first, while they fit in max_bytes, apart from
+ * the latest, which is always kept.
+ **/
+class DirtyLog {
+  public:
+    static const constexpr std::size_t DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+
+    explicit DirtyLog(const std::size_t max_bytes = DEFAULT_MAX_BYTES) : max_bytes(max_bytes), bytes(0) {}
+
+    void add(const std::uint64_t generation, std::shared_ptr<const DirtyTiles> tiles)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes += tiles->memory();
+        updates.emplace_back(generation, std::move(tiles));
+        while (bytes > max_bytes && updates.size() > 1)
+        {
+            bytes -= updates.front().second->memory();
+            updates.pop_front();
+        }
+    }
+
+    // Calls f(tiles) with the tiles changed by each update after since, and
+    // sets latest to the last update's generation.  Returns false if some of
+    // those updates have been forgotten.
+    template <typename F> bool since(const std::uint64_t since, std::uint64_t &latest, F f) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        latest = updates.empty() ? since : std::max(since, updates.back().first);
+        if (!updates.empty() && updates.front().first > since + 1) return false;
+        for (const auto &update : updates)
+        {
+            if (update.first > since) f(*update.second);
+        }
+        return true;
+    }
+
+    // Bytes held by the updates kept
+    std::size_t memory() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytes;
+    }
+
+  private:
+    const std::size_t max_bytes;
+    mutable std::mutex mutex;
+    std::size_t bytes;
+    std::deque<std::pair<std::uint64_t, std::shared_ptr<const DirtyTiles>>> updates;
+};
+
+} }
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "array.hpp"
+#include "common.hpp"
+#include "parallel.hpp"
+#include "snapshot.hpp"
+#include "varint.hpp"
+
+namespace util {
+
+/**
+ * Finds the edges between two OSM nodes, in a few bytes per edge.
+ *
+ * Edges are sorted by their node ids, smallest first, so a node pair is
+ * found whichever way round it's given.  Two ways can share an edge, so a
+ * pair may match more than one.  The sorted edges are delta encoded as
+ * varints in blocks of BLOCK_EDGES: each edge stores how far its smaller
+ * node id is from the last edge's, how far its larger node id is from its
+ * smaller one, and how far its edge id is from the last edge's.  Consecutive
+ * nodes of a way usually have nearby ids, and the edges between them get
+ * consecutive edge ids, so most edges take a byte or two for each of those.
+ *
+ * A directory indexed by the top bits of the smaller node id narrows a
+ * search down to a block or two, which are decoded from their start.
+ * Lookups in a batch are done in two passes, first prefetching where each
+ * one will start, so the cache misses of a batch overlap rather than
+ * queueing up one after another.
+ **/
+class EdgeLookup {
+  public:
+    EdgeLookup() : num_edges(0), shift(0) {}
+
+    // Sorts and encodes the edges on num_threads threads, with the same
+    // result however many there are
+    explicit EdgeLookup(const std::vector<nodepair_t> &edges, const std::size_t num_threads = 1) : num_edges(edges.size()), shift(0)
+    {
+        struct entry_t {
+            std::uint64_t low;
+            std::uint64_t high;
+            // edge id << 1, plus 1 if the edge runs from high to low
+            std::uint64_t edge;
+        };
+        std::vector<entry_t> entries(edges.size());
+        parallelFor(edges.size(), num_threads, [&](const std::size_t first, const std::size_t last) {
+            for (auto edge = first; edge < last; ++edge)
+            {
+                const auto &nodes = edges[edge];
+                const bool reversed = nodes.first > nodes.second;
+                entries[edge] = {reversed ? nodes.second : nodes.first, reversed ? nodes.first : nodes.second,
+                                 std::uint64_t{edge} << 1 | reversed};
+            }
+        });
+        parallelStableSort(entries.begin(), entries.end(), [](const entry_t &a, const entry_t &b) {
+            return a.low != b.low ? a.low < b.low : a.high != b.high ? a.high < b.high : a.edge < b.edge;
+        }, num_threads);
+
+        // Each thread encodes a run of whole blocks on its own, with offsets
+        // from the start of its run, and the runs are joined up after
+        const auto num_blocks = (entries.size() + BLOCK_EDGES - 1) / BLOCK_EDGES;
+        const auto num_parts = std::max<std::size_t>(1, std::min(num_threads, num_blocks));
+        std::vector<std::vector<std::uint8_t>> part_bytes(num_parts);
+        std::vector<std::vector<block_t>> part_blocks(num_parts);
+        parallelFor(num_parts, num_parts, [&](const std::size_t first_part, const std::size_t last_part) {
+            for (auto part = first_part; part < last_part; ++part)
+            {
+                const auto first = std::min(entries.size(), num_blocks * part / num_parts * BLOCK_EDGES);
+                const auto last = std::min(entries.size(), num_blocks * (part + 1) / num_parts * BLOCK_EDGES);
+                auto &encoded = part_bytes[part];
+                auto &starts = part_blocks[part];
+                std::uint64_t last_low = 0;
+                std::uint64_t last_edge = 0;
+                for (auto i = first; i < last; ++i)
+                {
+                    const auto &entry = entries[i];
+                    if (i % BLOCK_EDGES == 0)
+                    {
+                        starts.push_back({entry.low, encoded.size()});
+                        last_low = entry.low;
+                        last_edge = 0;
+                    }
+                    detail::writeVarint(encoded, entry.low - last_low);
+                    detail::writeVarint(encoded, entry.high - entry.low);
+                    detail::writeVarint(encoded, detail::zigzag(static_cast<std::int64_t>(entry.edge - last_edge)));
+                    last_low = entry.low;
+                    last_edge = entry.edge;
+                }
+            }
+        });
+
+        std::size_t total_bytes = 0;
+        for (const auto &encoded : part_bytes) total_bytes += encoded.size();
+        std::vector<std::uint8_t> encoded;
+        std::vector<block_t> starts;
+        encoded.reserve(total_bytes);
+        starts.reserve(num_blocks + 1);
+        for (std::size_t part = 0; part < num_parts; ++part)
+        {
+            for (const auto &block : part_blocks[part]) starts.push_back({block.first_low, block.offset + encoded.size()});
+            encoded.insert(encoded.end(), part_bytes[part].begin(), part_bytes[part].end());
+            std::vector<std::uint8_t>().swap(part_bytes[part]);
+        }
+        // Closes the last block, so every block ends where the next starts
+        starts.push_back({entries.empty() ? 0 : entries.back().low, encoded.size()});
+        bytes = Array<std::uint8_t>(std::move(encoded));
+        blocks = Array<block_t>(std::move(starts));
+
+        buildDirectory();
+    }
+
+    // Writes the lookup to a snapshot as sections starting with name
+    void save(snapshot::Writer &writer, const std::string &name) const
+    {
+        writer.addValue(name + ".edges", std::uint64_t{num_edges});
+        writer.addValue(name + ".shift", shift);
+        writer.add(name + ".bytes", bytes);
+        writer.add(name + ".blocks", blocks);
+        writer.add(name + ".directory", directory);
+    }
+
+    // Uses the lookup saved as name straight from the snapshot
+    void load(const snapshot::Reader &reader, const std::string &name)
+    {
+        num_edges = static_cast<std::size_t>(reader.value<std::uint64_t>(name + ".edges"));
+        shift = reader.value<int>(name + ".shift");
+        bytes = reader.array<std::uint8_t>(name + ".bytes");
+        blocks = reader.array<block_t>(name + ".blocks");
+        directory = reader.array<std::uint32_t>(name + ".directory");
+    }
+
+    // Calls f(edge, reversed) for every edge from node `from` to node `to`,
+    // where reversed is true if the edge runs from `to` to `from`
+    template <typename F> void forEach(const std::uint64_t from, const std::uint64_t to, F f) const
+    {
+        const bool reversed = from > to;
+        const auto low = reversed ? to : from;
+        const auto high = reversed ? from : to;
+        const auto block = startBlock(low);
+        if (block != NONE) scan(block, low, high, reversed, f);
+    }
+
+    /**
+     * Calls f(i, edge, reversed) for every edge between the nodes of pairs[i],
+     * going from first to second, for each i in [0, count), in order.  This
+     * does the same as calling forEach for each pair, but with the memory
+     * each lookup will need fetched ahead.
+     **/
+    template <typename F> void forEachBatch(const nodepair_t *pairs, const std::size_t count, F f) const
+    {
+        static const constexpr std::size_t BATCH = 16;
+        std::size_t starts[BATCH];
+        for (std::size_t first = 0; first < count; first += BATCH)
+        {
+            const auto batch = std::min(BATCH, count - first);
+            // The directory entries first, then the blocks they point at
+            for (std::size_t i = 0; i < batch; ++i)
+            {
+                const auto bucket = std::min(pairs[first + i].first, pairs[first + i].second) >> shift;
+                if (bucket + 1 < directory.size()) __builtin_prefetch(&directory[bucket]);
+            }
+            for (std::size_t i = 0; i < batch; ++i)
+            {
+                starts[i] = startBlock(std::min(pairs[first + i].first, pairs[first + i].second));
+                if (starts[i] != NONE) __builtin_prefetch(&bytes[blocks[starts[i]].offset]);
+            }
+            for (std::size_t i = 0; i < batch; ++i)
+            {
+                if (starts[i] == NONE) continue;
+                const auto &pair = pairs[first + i];
+                const bool reversed = pair.first > pair.second;
+                const auto index = first + i;
+                scan(starts[i], reversed ? pair.second : pair.first, reversed ? pair.first : pair.second, reversed,
+                     [&f, index](const edge_id_t edge, const bool reversed) { f(index, edge, reversed); });
+            }
+        }
+    }
+
+    std::size_t size() const { return num_edges; }
+    std::size_t memory() const
+    {
+        return bytes.bytes() + blocks.bytes() + directory.bytes();
+    }
+
+  private:
+    static const constexpr std::size_t BLOCK_EDGES = 32;
+    static const constexpr std::size_t NONE = static_cast<std::size_t>(-1);
+
+    struct block_t {
+        // Smaller node id of the block's first edge
+        std::uint64_t first_low;
+        // Where the block starts in bytes
+        std::uint64_t offset;
+    };
+
+    void buildDirectory()
+    {
+        directory = Array<std::uint32_t>();
+        shift = 0;
+        const auto num_blocks = blocks.size() - 1;
+        if (num_blocks == 0) return;
+        // Shift node ids down until there's about a bucket per block
+        const auto max_low = blocks.back().first_low;
+        while ((max_low >> shift) + 1 > num_blocks) ++shift;
+
+        // directory[b] is the first block starting in bucket b or later, and
+        // the last element closes the last bucket
+        const auto num_buckets = static_cast<std::size_t>(max_low >> shift) + 1;
+        std::vector<std::uint32_t> buckets(num_buckets + 1);
+        std::size_t block = 0;
+        for (std::size_t bucket = 0; bucket <= num_buckets; ++bucket)
+        {
+            while (block < num_blocks && (blocks[block].first_low >> shift) < bucket) ++block;
+            buckets[bucket] = static_cast<std::uint32_t>(block);
+        }
+        directory = Array<std::uint32_t>(std::move(buckets));
+    }
+
+    // The block to start scanning from for edges whose smaller node is low:
+    // the last one starting before it, as its edges can run on into the
+    // blocks after it
+    std::size_t startBlock(const std::uint64_t low) const
+    {
+        const auto bucket = low >> shift;
+        if (bucket + 1 >= directory.size()) return NONE;
+        const auto first = blocks.begin() + directory[bucket];
+        const auto last = blocks.begin() + directory[bucket + 1];
+        const auto found = std::lower_bound(first, last, low, [](const block_t &block, const std::uint64_t low) {
+            return block.first_low < low;
+        });
+        const auto index = static_cast<std::size_t>(found - blocks.begin());
+        return index == 0 ? 0 : index - 1;
+    }
+
+    template <typename F>
+    void scan(std::size_t block, const std::uint64_t low, const std::uint64_t high, const bool reversed, F &&f) const
+    {
+        const auto num_blocks = blocks.size() - 1;
+        for (; block < num_blocks; ++block)
+        {
+            const std::uint8_t *p = &bytes[blocks[block].offset];
+            const std::uint8_t *end = bytes.data() + blocks[block + 1].offset;
+            std::uint64_t entry_low = blocks[block].first_low;
+            std::uint64_t entry_edge = 0;
+            while (p != end)
+            {
+                entry_low += detail::readVarint(p);
+                const auto entry_high = entry_low + detail::readVarint(p);
+                entry_edge += static_cast<std::uint64_t>(detail::unzigzag(detail::readVarint(p)));
+                if (entry_low < low || (entry_low == low && entry_high < high)) continue;
+                if (entry_low > low || entry_high > high) return;
+                f(static_cast<edge_id_t>(entry_edge >> 1), (entry_edge & 1) != reversed);
+            }
+        }
+    }
+
+    std::size_t num_edges;
+    Array<std::uint8_t> bytes;
+    // One per block, and one more closing the last
+    Array<block_t> blocks;
+    Array<std::uint32_t> directory;
+    int shift;
+};
+
+}
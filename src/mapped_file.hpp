@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace util {
+
+/**
+ * A whole file mapped read-only into memory, for the lifetime of the object.
+ * Pages are read in by the kernel as they're touched, and live in the page
+ * cache rather than on our heap.
+ **/
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &path) : data_(nullptr), size_(0)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) fail(path, errno);
+
+        struct stat info;
+        if (fstat(fd, &info) == -1)
+        {
+            const int error = errno;
+            close(fd);
+            fail(path, error);
+        }
+        size_ = static_cast<std::size_t>(info.st_size);
+
+        // mmap refuses empty mappings, and there's nothing to map anyway
+        if (size_ > 0)
+        {
+            void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                const int error = errno;
+                close(fd);
+                fail(path, error);
+            }
+            data_ = static_cast<const char *>(mapped);
+        }
+        // The mapping holds its own reference to the file
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data_ != nullptr) munmap(const_cast<char *>(data_), size_);
+    }
+
+    // Hints that the file will be read from start to end
+    void adviseSequential() const
+    {
+        if (data_ != nullptr) madvise(const_cast<char *>(data_), size_, MADV_SEQUENTIAL);
+    }
+
+    const char *data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+  private:
+    static void fail(const std::string &path, const int error)
+    {
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    }
+
+    const char *data_;
+    std::size_t size_;
+};
+
+}
@@ -1,103 +1,279 @@
 #pragma once
 
 #include "tile.hpp"
-#include <unordered_map>
-#include <vector>
 #include <cstdint>
+#include <limits>
+#include <vector>
 
-typedef std::vector<util::tile::tile_linestring_t> tile_line_vector;
-typedef std::unordered_map<util::tile::tile_point_t, std::vector<std::size_t>, util::tile::tile_point_hash, util::tile::tile_point_equal> coordinate_line_map;
-
-void merge(const util::tile::tile_linestring_t &tile_line, tile_line_vector &lines, coordinate_line_map &starts, coordinate_line_map &ends) {
+/**
+ * Joins the lines on a tile into longer ones as they're added, so the tile
+ * has fewer features and encodes smaller.  A line starting where another
+ * ends is appended to it, one ending where another starts is prepended, and
+ * one bridging the end of a line to the start of another joins them.
+ *
+ * Lines are chains of points linked through `next`, so appending, prepending
+ * and joining are all constant time, and nothing is copied until the lines
+ * are read out with forEachLine.  Endpoints are found through an open
+ * addressing hash keyed on the packed coordinates.  Every endpoint keeps a
+ * list of the lines starting there and one of the lines ending there, linked
+ * through the lines themselves, and the most recently added is used first.
+ *
+ * All storage is kept by clear(), so a merger reused from tile to tile stops
+ * allocating once it has seen a busy one.
+ **/
+class LineMerger {
+  public:
+    LineMerger() : num_slots(0), slot_bits(0) {}
 
-    const auto endmatch = ends.find(tile_line.front());
-    const auto startmatch = starts.find(tile_line.back());
+    void clear()
+    {
+        // Empty just the slots in use, rather than the whole table
+        for (std::uint32_t endpoint = 0; endpoint < endpoints.size(); ++endpoint)
+        {
+            auto slot = slotOf(endpoints[endpoint].key);
+            while (slots[slot] != endpoint) slot = (slot + 1) & (num_slots - 1);
+            slots[slot] = NONE;
+        }
+        points.clear();
+        lines.clear();
+        endpoints.clear();
+    }
 
-    // Joining two existing lines
-    if (endmatch != ends.end() && startmatch != starts.end())
+    // Adds a line of two or more points
+    void add(const util::tile::tile_linestring_t &line)
     {
-        // Do the append
-        // We just pick the first value we find (TODO: a heuristic to optimize line lengths?)
-        const auto firstline = endmatch->second.back();
-        const auto secondline = startmatch->second.back();
+        const auto num_points = line.size();
+        const auto front_key = pack(line.front());
+        const auto back_key = pack(line.back());
+        // A single segment of 0 length
+        const bool empty = num_points == 2 && front_key == back_key;
+        const auto front_endpoint = find(front_key);
+        const auto back_endpoint = find(back_key);
+        const auto endmatch = front_endpoint == NONE ? NONE : endpoints[front_endpoint].ends;
+        const auto startmatch = back_endpoint == NONE ? NONE : endpoints[back_endpoint].starts;
 
-        // If this won't create a self-join (we're only handling lines here, not polygons
-        if (firstline != secondline)
+        // Joining two existing lines, unless that would close a loop
+        if (endmatch != NONE && startmatch != NONE && endmatch != startmatch)
         {
-            //std::cout << "Copying from " << secondline << " to  " << firstline << " and size is  " << lines.size() << std::endl;
-            lines[firstline].insert(lines[firstline].end(), lines[secondline].begin(), lines[secondline].end());
+            unlinkEnd(endmatch);
+            unlinkStart(startmatch);
+            unlinkEnd(startmatch);
 
-            // Remove the item we found
-            endmatch->second.pop_back();
-            startmatch->second.pop_back();
-            if (endmatch->second.empty()) { ends.erase(endmatch->first); }
-            if (startmatch->second.empty()) { starts.erase(startmatch->first); }
+            auto &first = lines[endmatch];
+            auto &second = lines[startmatch];
+            // The line's own ends are already the ends of the two it joins,
+            // so only its inner points go in between.  A zero length bridge
+            // would leave the join point in twice.
+            const auto tail = addPoints(first.tail, line, 1, num_points - 1);
+            points[tail].next = empty ? points[second.head].next : second.head;
+            first.tail = second.tail;
+            first.end = second.end;
+            second.head = NONE;
+            linkEnd(endmatch);
+            return;
+        }
 
-            // Make sure the end of the second line is no longer linked
-            const auto tmpsecond = ends.find(lines[firstline].back());
-            tmpsecond->second.erase(std::remove(tmpsecond->second.begin(), tmpsecond->second.end(), secondline), tmpsecond->second.end());
+        // Appending to the end of another line.  If there is already a line,
+        // and this one has 0 length, discard it.
+        if (endmatch != NONE)
+        {
+            if (empty) return;
+            unlinkEnd(endmatch);
+            auto &chain = lines[endmatch];
+            chain.tail = addPoints(chain.tail, line, 1, num_points);
+            chain.end = back_endpoint == NONE ? insert(back_key) : back_endpoint;
+            linkEnd(endmatch);
+            return;
+        }
+
+        // Prepending to an existing line
+        if (startmatch != NONE)
+        {
+            if (empty) return;
+            unlinkStart(startmatch);
+            const auto head = addPoint(line.front());
+            auto &chain = lines[startmatch];
+            const auto tail = addPoints(head, line, 1, num_points - 1);
+            points[tail].next = chain.head;
+            chain.head = head;
+            chain.start = front_endpoint == NONE ? insert(front_key) : front_endpoint;
+            linkStart(startmatch);
+            return;
+        }
 
-            // The endpoint of the second line now belongs to the first line,
-            // so make sure the last coordinate is in the ends index.
-            auto result = ends.emplace(lines[firstline].back(), std::vector<std::size_t>{firstline});
-            if (!result.second) { result.first->second.push_back(firstline); }
+        // Nothing to join to, start a new line
+        const auto start = front_endpoint == NONE ? insert(front_key) : front_endpoint;
+        const auto end = front_key == back_key ? start : back_endpoint == NONE ? insert(back_key) : back_endpoint;
+        const auto head = addPoint(line.front());
+        const auto tail = addPoints(head, line, 1, num_points);
 
-            // No need to delete the line, nobody refers to it any more
-            //lines.erase(lines.begin()+secondline);
+        const auto id = static_cast<std::uint32_t>(lines.size());
+        lines.push_back({head, tail, start, end, NONE, NONE, NONE, NONE});
+        linkStart(id);
+        linkEnd(id);
+    }
 
-            return;
+    // Calls f with each merged line, in the order the lines were started.
+    // line is used to hold the points, and f is free to modify it.
+    template <typename F> void forEachLine(util::tile::tile_linestring_t &line, F f) const
+    {
+        for (const auto &chain : lines)
+        {
+            if (chain.head == NONE) continue;
+            line.clear();
+            for (auto point = chain.head; point != NONE; point = points[point].next)
+            {
+                line.emplace_back(points[point].x, points[point].y);
+            }
+            f(line);
         }
     }
 
-    // Appending to the end of another line
-    // Note: we mail end up here if the previous step detected a join, but deicded it would
-    // create a loop.
-    if (endmatch != ends.end())
+    std::size_t numLines() const
     {
-        // If there is already a line, and this line has 0 length, discard this line
-        if (util::tile::tile_point_equal()(tile_line.front(), tile_line.back())) return;
-        const auto endindex = endmatch->second.back();
-        const auto lastpt = tile_line.back();
-        // Remove the old endpoint
-        endmatch->second.pop_back();
-        if (endmatch->second.empty()) { ends.erase(endmatch->first); }
+        std::size_t result = 0;
+        for (const auto &chain : lines) result += chain.head != NONE;
+        return result;
+    }
 
-        // Add the coordinate to the vector
-        lines[endindex].emplace_back(lastpt.get<0>(), lastpt.get<1>());
+  private:
+    static const constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
 
-        // Ensure the new end coordinate links to the right vector
-        auto result = ends.emplace(lines[endindex].back(), std::vector<std::size_t>{endindex});
-        if (!result.second) { result.first->second.push_back(endindex); }
+    struct point_t {
+        std::int32_t x;
+        std::int32_t y;
+        std::uint32_t next;
+    };
 
-        return;
+    // head is NONE once the line has been joined onto another
+    struct line_t {
+        std::uint32_t head;
+        std::uint32_t tail;
+        // Endpoints the line starts and ends at
+        std::uint32_t start;
+        std::uint32_t end;
+        // Neighbours in the lists of lines sharing the same start and end
+        std::uint32_t prev_at_start;
+        std::uint32_t next_at_start;
+        std::uint32_t prev_at_end;
+        std::uint32_t next_at_end;
+    };
+
+    struct endpoint_t {
+        std::uint64_t key;
+        // Most recently linked line starting/ending here
+        std::uint32_t starts;
+        std::uint32_t ends;
+    };
+
+    static std::uint64_t pack(const util::tile::tile_point_t &point)
+    {
+        return (std::uint64_t{static_cast<std::uint32_t>(point.get<0>())} << 32) | static_cast<std::uint32_t>(point.get<1>());
     }
 
-    // Prepending to an existing line
-    if (startmatch != starts.end()) {
-        // If there is already a line, and this line has 0 length, discard this line
-        if (util::tile::tile_point_equal()(tile_line.front(), tile_line.back())) return;
-        const auto startindex = startmatch->second.back();
-        const auto firstpt = tile_line.front();
+    // Fibonacci hashing onto the slot table
+    std::size_t slotOf(const std::uint64_t key) const
+    {
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> (64 - slot_bits));
+    }
 
-        // Remove the old startpoint
-        startmatch->second.pop_back();
-        if (startmatch->second.empty()) { starts.erase(startmatch->first); }
+    std::uint32_t find(const std::uint64_t key) const
+    {
+        if (num_slots == 0) return NONE;
+        for (auto slot = slotOf(key);; slot = (slot + 1) & (num_slots - 1))
+        {
+            const auto endpoint = slots[slot];
+            if (endpoint == NONE || endpoints[endpoint].key == key) return endpoint;
+        }
+    }
+
+    // Adds an endpoint known not to be in the table yet
+    std::uint32_t insert(const std::uint64_t key)
+    {
+        // Keep the table at most half full
+        if ((endpoints.size() + 1) * 2 > num_slots) grow();
+        const auto endpoint = static_cast<std::uint32_t>(endpoints.size());
+        endpoints.push_back({key, NONE, NONE});
+        place(endpoint);
+        return endpoint;
+    }
+
+    void place(const std::uint32_t endpoint)
+    {
+        auto slot = slotOf(endpoints[endpoint].key);
+        while (slots[slot] != NONE) slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = endpoint;
+    }
 
-        // Prepend the new coordinate
-        lines[startindex].emplace(lines[startindex].begin(), firstpt.get<0>(), firstpt.get<1>());
+    void grow()
+    {
+        num_slots = num_slots == 0 ? 256 : num_slots * 2;
+        slot_bits = 0;
+        while ((std::size_t{1} << slot_bits) < num_slots) ++slot_bits;
+        slots.assign(num_slots, std::uint32_t{NONE});
+        for (std::uint32_t endpoint = 0; endpoint < endpoints.size(); ++endpoint) place(endpoint);
+    }
 
-        // Ensure the new start coordinate
-        auto result = starts.emplace(lines[startindex].front(), std::vector<std::size_t>{startindex});
-        if (!result.second) { result.first->second.push_back(startindex); }
+    std::uint32_t addPoint(const util::tile::tile_point_t &point)
+    {
+        points.push_back({point.get<0>(), point.get<1>(), NONE});
+        return static_cast<std::uint32_t>(points.size() - 1);
+    }
 
-        return;
+    // Chains points [first, last) of line on after the point `after`, and
+    // returns the new last point
+    std::uint32_t addPoints(std::uint32_t after, const util::tile::tile_linestring_t &line, const std::size_t first, const std::size_t last)
+    {
+        for (auto i = first; i < last; ++i)
+        {
+            const auto point = addPoint(line[i]);
+            points[after].next = point;
+            after = point;
+        }
+        return after;
+    }
+
+    void linkStart(const std::uint32_t id)
+    {
+        auto &line = lines[id];
+        auto &head = endpoints[line.start].starts;
+        line.prev_at_start = NONE;
+        line.next_at_start = head;
+        if (head != NONE) lines[head].prev_at_start = id;
+        head = id;
+    }
+
+    void unlinkStart(const std::uint32_t id)
+    {
+        const auto &line = lines[id];
+        if (line.prev_at_start != NONE) lines[line.prev_at_start].next_at_start = line.next_at_start;
+        else endpoints[line.start].starts = line.next_at_start;
+        if (line.next_at_start != NONE) lines[line.next_at_start].prev_at_start = line.prev_at_start;
+    }
+
+    void linkEnd(const std::uint32_t id)
+    {
+        auto &line = lines[id];
+        auto &head = endpoints[line.end].ends;
+        line.prev_at_end = NONE;
+        line.next_at_end = head;
+        if (head != NONE) lines[head].prev_at_end = id;
+        head = id;
+    }
+
+    void unlinkEnd(const std::uint32_t id)
+    {
+        const auto &line = lines[id];
+        if (line.prev_at_end != NONE) lines[line.prev_at_end].next_at_end = line.next_at_end;
+        else endpoints[line.end].ends = line.next_at_end;
+        if (line.next_at_end != NONE) lines[line.next_at_end].prev_at_end = line.prev_at_end;
     }
 
-    // Nothing to join to, insert a new line
-    lines.push_back(tile_line);
-    const auto lineid = lines.size() - 1;
-    auto startresult = starts.emplace(tile_line.front(), std::vector<std::size_t>{ lineid });
-    if (!startresult.second) { startresult.first->second.push_back(lineid); }
-    auto endresult = ends.emplace(tile_line.back(), std::vector<std::size_t>{ lines.size() -1 });
-    if (!endresult.second) { endresult.first->second.push_back(lineid); }
-}
+    std::vector<point_t> points;
+    std::vector<line_t> lines;
+    std::vector<endpoint_t> endpoints;
+    // Open addressing table of indices into endpoints, NONE where empty
+    std::vector<std::uint32_t> slots;
+    std::size_t num_slots;
+    int slot_bits;
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "varint.hpp"
+
+namespace util {
+
+/**
+ * A set of OSM node ids, one bit per id.  Ids come in pages of PAGE_IDS,
+ * which are only allocated once an id in them is added, so the gaps in the
+ * id space cost a few bytes per page.
+ *
+ * Once finish() has been called, rank(id) is the number of ids in the set
+ * smaller than id, which numbers the ids in the set densely in id order:
+ * a count of the ids in each page before it, and of the ids in each block
+ * of a page before it, leave at most a block's words to count.
+ **/
+class NodeIdSet {
+  public:
+    static const constexpr std::uint64_t PAGE_IDS = 1 << 16;
+
+    NodeIdSet() : count(0) {}
+
+    void add(const std::uint64_t id)
+    {
+        const auto page = id / PAGE_IDS;
+        if (page >= pages.size()) pages.resize(page + 1);
+        auto &words = pages[page].words;
+        if (words.empty()) words.resize(PAGE_WORDS);
+        words[(id % PAGE_IDS) / 64] |= std::uint64_t{1} << (id % 64);
+    }
+
+    bool contains(const std::uint64_t id) const
+    {
+        const auto page = id / PAGE_IDS;
+        if (page >= pages.size() || pages[page].words.empty()) return false;
+        return (pages[page].words[(id % PAGE_IDS) / 64] >> (id % 64)) & 1;
+    }
+
+    // Counts the ids for rank(), after which nothing more can be added
+    void finish()
+    {
+        count = 0;
+        for (auto &page : pages)
+        {
+            page.rank = count;
+            if (page.words.empty()) continue;
+            page.block_ranks.resize(PAGE_WORDS / BLOCK_WORDS);
+            std::uint64_t in_page = 0;
+            for (std::size_t word = 0; word < PAGE_WORDS; ++word)
+            {
+                if (word % BLOCK_WORDS == 0) page.block_ranks[word / BLOCK_WORDS] = static_cast<std::uint16_t>(in_page);
+                in_page += static_cast<std::uint64_t>(__builtin_popcountll(page.words[word]));
+            }
+            count += in_page;
+        }
+    }
+
+    // The number of ids in the set smaller than id
+    std::uint64_t rank(const std::uint64_t id) const
+    {
+        const auto page_index = id / PAGE_IDS;
+        if (page_index >= pages.size()) return count;
+        const auto &page = pages[page_index];
+        if (page.words.empty()) return page.rank;
+        const auto word = (id % PAGE_IDS) / 64;
+        std::uint64_t result = page.rank + page.block_ranks[word / BLOCK_WORDS];
+        for (auto i = word - word % BLOCK_WORDS; i < word; ++i) result += static_cast<std::uint64_t>(__builtin_popcountll(page.words[i]));
+        return result + static_cast<std::uint64_t>(__builtin_popcountll(page.words[word] & ((std::uint64_t{1} << (id % 64)) - 1)));
+    }
+
+    // Ids in the set, once finished
+    std::uint64_t size() const { return count; }
+
+    std::size_t memory() const
+    {
+        std::size_t result = pages.capacity() * sizeof(page_t);
+        for (const auto &page : pages) result += page.words.capacity() * sizeof(std::uint64_t) + page.block_ranks.capacity() * sizeof(std::uint16_t);
+        return result;
+    }
+
+  private:
+    static const constexpr std::size_t PAGE_WORDS = PAGE_IDS / 64;
+    static const constexpr std::size_t BLOCK_WORDS = 8;
+
+    struct page_t {
+        // Empty until an id in the page is added
+        std::vector<std::uint64_t> words;
+        // Ids in the page before each block of BLOCK_WORDS words
+        std::vector<std::uint16_t> block_ranks;
+        // Ids in the set before the page
+        std::uint64_t rank = 0;
+    };
+
+    std::vector<page_t> pages;
+    std::uint64_t count;
+};
+
+/**
+ * Locations of just the nodes in a NodeIdSet, stored by rank so there's no
+ * id to keep per node.  Nodes come in id order, as they do in a sorted OSM
+ * file, so consecutive ones are usually near each other, and each location
+ * is kept as zigzag varint deltas from the one before.  Every BLOCK_NODES
+ * nodes start a block holding its first location in full, which is where
+ * a lookup starts decoding from.
+ *
+ * Bytes are kept in fixed size chunks rather than one vector, so growing
+ * never needs room for two copies of them.
+ *
+ * Locations are a pair of int32 coordinates, osmium's fixed point ones,
+ * and a node of the set that's missing from the file gets MISSING for both.
+ **/
+class NodeLocations {
+  public:
+    static const constexpr std::int32_t MISSING = std::numeric_limits<std::int32_t>::max();
+
+    explicit NodeLocations(const NodeIdSet &ids) : ids(ids), num_nodes(0), last_x(0), last_y(0)
+    {
+        block_offsets.reserve(static_cast<std::size_t>((ids.size() + BLOCK_NODES - 1) / BLOCK_NODES));
+    }
+
+    NodeLocations(const NodeLocations &) = delete;
+    NodeLocations &operator=(const NodeLocations &) = delete;
+
+    // Adds a node's location if it's in the set.  Nodes have to come in
+    // increasing id order.
+    void add(const std::uint64_t id, const std::int32_t x, const std::int32_t y)
+    {
+        if (!ids.contains(id)) return;
+        const auto rank = ids.rank(id);
+        if (rank < num_nodes) throw std::runtime_error("node " + std::to_string(id) + " is out of order, the file needs to be sorted by id");
+        while (num_nodes < rank) append(MISSING, MISSING);
+        append(x, y);
+    }
+
+    // Marks the nodes of the set that never came as missing
+    void finish()
+    {
+        while (num_nodes < ids.size()) append(MISSING, MISSING);
+    }
+
+    // Sets x and y and returns true for a node in the set
+    bool get(const std::uint64_t id, std::int32_t &x, std::int32_t &y) const
+    {
+        if (!ids.contains(id)) return false;
+        const auto rank = ids.rank(id);
+        if (rank >= num_nodes) return false;
+        const auto offset = block_offsets[static_cast<std::size_t>(rank / BLOCK_NODES)];
+        const std::uint8_t *p = chunks[static_cast<std::size_t>(offset / CHUNK_BYTES)].data() + offset % CHUNK_BYTES;
+        std::int64_t node_x = detail::unzigzag(detail::readVarint(p));
+        std::int64_t node_y = detail::unzigzag(detail::readVarint(p));
+        for (auto i = rank % BLOCK_NODES; i > 0; --i)
+        {
+            node_x += detail::unzigzag(detail::readVarint(p));
+            node_y += detail::unzigzag(detail::readVarint(p));
+        }
+        x = static_cast<std::int32_t>(node_x);
+        y = static_cast<std::int32_t>(node_y);
+        return true;
+    }
+
+    // Bytes in use, chunks are reserved whole but only touched as they fill
+    std::size_t memory() const
+    {
+        std::size_t result = block_offsets.capacity() * sizeof(std::uint64_t);
+        for (const auto &bytes : chunks) result += bytes.size();
+        return result;
+    }
+
+  private:
+    static const constexpr std::uint64_t BLOCK_NODES = 16;
+    static const constexpr std::uint64_t CHUNK_BYTES = 1 << 24;
+    // Two 10 byte varints per node
+    static const constexpr std::uint64_t MAX_BLOCK_BYTES = BLOCK_NODES * 20;
+
+    void append(const std::int32_t x, const std::int32_t y)
+    {
+        if (num_nodes % BLOCK_NODES == 0)
+        {
+            // Blocks never straddle chunks
+            if (chunks.empty() || chunks.back().size() + MAX_BLOCK_BYTES > CHUNK_BYTES)
+            {
+                chunks.emplace_back();
+                chunks.back().reserve(CHUNK_BYTES);
+            }
+            block_offsets.push_back((chunks.size() - 1) * CHUNK_BYTES + chunks.back().size());
+            last_x = 0;
+            last_y = 0;
+        }
+        auto &bytes = chunks.back();
+        detail::writeVarint(bytes, detail::zigzag(std::int64_t{x} - last_x));
+        detail::writeVarint(bytes, detail::zigzag(std::int64_t{y} - last_y));
+        last_x = x;
+        last_y = y;
+        ++num_nodes;
+    }
+
+    const NodeIdSet &ids;
+    std::uint64_t num_nodes;
+    std::vector<std::vector<std::uint8_t>> chunks;
+    // Where each block starts, as chunk * CHUNK_BYTES + offset in the chunk
+    std::vector<std::uint64_t> block_offsets;
+    std::int64_t last_x;
+    std::int64_t last_y;
+};
+
+}
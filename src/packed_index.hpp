@@ -0,0 +1,364 @@
+#pragma once
+
+#include "array.hpp"
+#include "common.hpp"
+#include "parallel.hpp"
+#include "snapshot.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace util {
+
+namespace detail {
+// Position of (x,y) along a Hilbert curve filling a 2^16 x 2^16 grid.
+// Branch-free version from http://threadlocalmutex.com/?p=126
+inline std::uint32_t hilbertIndex(std::uint32_t x, std::uint32_t y)
+{
+    std::uint32_t a = x ^ y;
+    std::uint32_t b = 0xFFFF ^ a;
+    std::uint32_t c = 0xFFFF ^ (x | y);
+    std::uint32_t d = x & (y ^ 0xFFFF);
+
+    std::uint32_t A = a | (b >> 1);
+    std::uint32_t B = (a >> 1) ^ a;
+    std::uint32_t C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+    std::uint32_t D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+    a = A; b = B; c = C; d = D;
+    A = ((a & (a >> 2)) ^ (b & (b >> 2)));
+    B = ((a & (b >> 2)) ^ (b & ((a ^ b) >> 2)));
+    C ^= ((a & (c >> 2)) ^ (b & (d >> 2)));
+    D ^= ((b & (c >> 2)) ^ ((a ^ b) & (d >> 2)));
+
+    a = A; b = B; c = C; d = D;
+    A = ((a & (a >> 4)) ^ (b & (b >> 4)));
+    B = ((a & (b >> 4)) ^ (b & ((a ^ b) >> 4)));
+    C ^= ((a & (c >> 4)) ^ (b & (d >> 4)));
+    D ^= ((b & (c >> 4)) ^ ((a ^ b) & (d >> 4)));
+
+    a = A; b = B; c = C; d = D;
+    C ^= ((a & (c >> 8)) ^ (b & (d >> 8)));
+    D ^= ((b & (c >> 8)) ^ ((a ^ b) & (d >> 8)));
+
+    a = C ^ (C >> 1);
+    b = D ^ (D >> 1);
+
+    std::uint32_t i0 = x ^ y;
+    std::uint32_t i1 = b | (0xFFFF ^ (i0 | a));
+
+    i0 = (i0 | (i0 << 8)) & 0x00FF00FF;
+    i0 = (i0 | (i0 << 4)) & 0x0F0F0F0F;
+    i0 = (i0 | (i0 << 2)) & 0x33333333;
+    i0 = (i0 | (i0 << 1)) & 0x55555555;
+
+    i1 = (i1 | (i1 << 8)) & 0x00FF00FF;
+    i1 = (i1 | (i1 << 4)) & 0x0F0F0F0F;
+    i1 = (i1 | (i1 << 2)) & 0x33333333;
+    i1 = (i1 | (i1 << 1)) & 0x55555555;
+
+    return (i1 << 1) | i0;
+}
+}
+
+/**
+ * A static R-tree packed bottom up over items sorted along a Hilbert curve
+ * (the same idea as flatbush).  Building it reorders the items themselves, so
+ * each leaf covers a contiguous run of NODE_SIZE items in the caller's array
+ * and a query hands back index ranges into that array rather than copies.
+ *
+ * All nodes live in one flat array, leaves first and the root last, and each
+ * holds just the bounding box of its children.  That array is all there is
+ * to the tree, so a snapshot of it can be queried where it's mapped.
+ **/
+class PackedIndex {
+  public:
+    static const constexpr std::uint32_t NODE_SIZE = 16;
+
+    // A [first, last) range of item indices
+    typedef std::pair<std::uint32_t, std::uint32_t> range_t;
+
+    PackedIndex() : num_items(0) {}
+
+    // Sorts items along the Hilbert curve and builds the tree over them.
+    // indexable maps an item to its world_box_t.  The keys, the sort and
+    // the leaves are done on num_threads threads, with the same result
+    // however many there are.
+    template <typename T, typename Indexable> void build(std::vector<T> &items, const Indexable &indexable, const std::size_t num_threads = 1)
+    {
+        num_items = static_cast<std::uint32_t>(items.size());
+        nodes = Array<node_t>();
+        level_bounds = Array<std::uint32_t>();
+        if (items.empty()) return;
+
+        // Sort on the Hilbert value of each box centre, using the top 16 bits
+        // of the world coordinates.  Ties keep their load order.
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> keys(items.size());
+        parallelFor(items.size(), num_threads, [&](const std::size_t first, const std::size_t last) {
+            for (auto i = first; i < last; ++i)
+            {
+                const auto box = indexable(items[i]);
+                const std::uint64_t center_x = (std::uint64_t{box.min_corner().template get<0>()} + box.max_corner().template get<0>()) / 2;
+                const std::uint64_t center_y = (std::uint64_t{box.min_corner().template get<1>()} + box.max_corner().template get<1>()) / 2;
+                keys[i] = {detail::hilbertIndex(static_cast<std::uint32_t>(center_x >> 16), static_cast<std::uint32_t>(center_y >> 16)),
+                           static_cast<std::uint32_t>(i)};
+            }
+        });
+        parallelStableSort(keys.begin(), keys.end(), std::less<std::pair<std::uint32_t, std::uint32_t>>(), num_threads);
+
+        std::vector<T> sorted(items.size());
+        parallelFor(items.size(), num_threads, [&](const std::size_t first, const std::size_t last) {
+            for (auto i = first; i < last; ++i) sorted[i] = items[keys[i].second];
+        });
+        items.swap(sorted);
+
+        // Leaves, one per NODE_SIZE items
+        const auto num_leaves = (num_items + NODE_SIZE - 1) / NODE_SIZE;
+        std::vector<node_t> tree(num_leaves);
+        std::vector<std::uint32_t> bounds;
+        bounds.push_back(0);
+        parallelFor(num_leaves, num_threads, [&](const std::size_t first_leaf, const std::size_t last_leaf) {
+            for (auto leaf = first_leaf; leaf < last_leaf; ++leaf)
+            {
+                const auto first = static_cast<std::uint32_t>(leaf * NODE_SIZE);
+                const auto last = std::min(num_items, first + NODE_SIZE);
+                node_t node = emptyNode();
+                for (auto i = first; i < last; ++i)
+                {
+                    extend(node, indexable(items[i]));
+                }
+                tree[leaf] = node;
+            }
+        });
+
+        // Then each level above packs NODE_SIZE nodes of the one below, up to a single root
+        while (tree.size() - bounds.back() > 1)
+        {
+            const auto level_first = bounds.back();
+            const auto level_last = static_cast<std::uint32_t>(tree.size());
+            bounds.push_back(level_last);
+            for (auto first = level_first; first < level_last; first += NODE_SIZE)
+            {
+                const auto last = std::min(level_last, first + NODE_SIZE);
+                node_t node = emptyNode();
+                for (auto i = first; i < last; ++i)
+                {
+                    extend(node, tree[i]);
+                }
+                tree.push_back(node);
+            }
+        }
+        bounds.push_back(static_cast<std::uint32_t>(tree.size()));
+        nodes = Array<node_t>(std::move(tree));
+        level_bounds = Array<std::uint32_t>(std::move(bounds));
+    }
+
+    // Writes the tree to a snapshot as sections starting with name
+    void save(snapshot::Writer &writer, const std::string &name) const
+    {
+        writer.addValue(name + ".items", num_items);
+        writer.add(name + ".nodes", nodes);
+        writer.add(name + ".levels", level_bounds);
+    }
+
+    // Uses the tree saved as name straight from the snapshot
+    void load(const snapshot::Reader &reader, const std::string &name)
+    {
+        num_items = reader.value<std::uint32_t>(name + ".items");
+        nodes = reader.array<node_t>(name + ".nodes");
+        level_bounds = reader.array<std::uint32_t>(name + ".levels");
+    }
+
+    // Appends the item ranges of all leaves intersecting box, in item order
+    // and with adjacent ones joined, shifted by offset.  Items inside a range
+    // still need to be checked individually.
+    void query(const world_box_t &box, std::vector<range_t> &ranges, std::vector<std::uint32_t> &stack, const std::uint32_t offset = 0) const
+    {
+        if (nodes.empty()) return;
+
+        const node_t query_box = {box.min_corner().get<0>(), box.min_corner().get<1>(),
+                                  box.max_corner().get<0>(), box.max_corner().get<1>()};
+
+        // Depth first, pushing children in reverse so they're visited in order.
+        // Entries are (level, node index within the whole array).
+        stack.clear();
+        stack.push_back(static_cast<std::uint32_t>(level_bounds.size() - 2));
+        stack.push_back(static_cast<std::uint32_t>(nodes.size() - 1));
+        while (!stack.empty())
+        {
+            const auto node_index = stack.back();
+            stack.pop_back();
+            const auto level = stack.back();
+            stack.pop_back();
+
+            const auto &node = nodes[node_index];
+            if (node.max_x < query_box.min_x || node.min_x > query_box.max_x ||
+                node.max_y < query_box.min_y || node.min_y > query_box.max_y)
+            {
+                continue;
+            }
+
+            const auto position = node_index - level_bounds[level];
+            if (level == 0)
+            {
+                const auto first = offset + position * NODE_SIZE;
+                const auto last = offset + std::min(num_items, position * NODE_SIZE + NODE_SIZE);
+                if (!ranges.empty() && ranges.back().second == first)
+                {
+                    ranges.back().second = last;
+                }
+                else
+                {
+                    ranges.emplace_back(first, last);
+                }
+                continue;
+            }
+
+            const auto child_first = level_bounds[level - 1] + position * NODE_SIZE;
+            const auto child_last = std::min(level_bounds[level], child_first + NODE_SIZE);
+            for (auto child = child_last; child > child_first; --child)
+            {
+                stack.push_back(level - 1);
+                stack.push_back(child - 1);
+            }
+        }
+    }
+
+    std::size_t size() const { return num_items; }
+    std::size_t memory() const { return nodes.bytes() + level_bounds.bytes(); }
+
+  private:
+    struct node_t {
+        std::uint32_t min_x;
+        std::uint32_t min_y;
+        std::uint32_t max_x;
+        std::uint32_t max_y;
+    };
+
+    static node_t emptyNode() { return {0xFFFFFFFF, 0xFFFFFFFF, 0, 0}; }
+
+    static void extend(node_t &node, const world_box_t &box)
+    {
+        node.min_x = std::min(node.min_x, box.min_corner().get<0>());
+        node.min_y = std::min(node.min_y, box.min_corner().get<1>());
+        node.max_x = std::max(node.max_x, box.max_corner().get<0>());
+        node.max_y = std::max(node.max_y, box.max_corner().get<1>());
+    }
+
+    static void extend(node_t &node, const node_t &child)
+    {
+        node.min_x = std::min(node.min_x, child.min_x);
+        node.min_y = std::min(node.min_y, child.min_y);
+        node.max_x = std::max(node.max_x, child.max_x);
+        node.max_y = std::max(node.max_y, child.max_y);
+    }
+
+    std::uint32_t num_items;
+    Array<node_t> nodes;
+    // Offset of the first node of each level in nodes, plus nodes.size()
+    Array<std::uint32_t> level_bounds;
+};
+
+/**
+ * A separate PackedIndex for each minzoom band.  Items are grouped by minzoom,
+ * lowest first, and Hilbert sorted within their group, so a query at zoom z
+ * only visits the bands visible at z.  Low zoom tiles then cost in proportion
+ * to the motorways they show rather than to everything underneath them.
+ **/
+class ZoomIndex {
+  public:
+    // Sorts items into bands, and along the Hilbert curve within each band,
+    // then builds a PackedIndex per band.  minzoom maps an item to its band.
+    template <typename T, typename Minzoom, typename Indexable>
+    void build(std::vector<T> &items, const Minzoom &minzoom, const Indexable &indexable, const std::size_t num_threads = 1)
+    {
+        bands.clear();
+        parallelStableSort(items.begin(), items.end(), [&minzoom](const T &a, const T &b) { return minzoom(a) < minzoom(b); }, num_threads);
+
+        std::vector<T> band_items;
+        for (auto first = items.begin(); first != items.end();)
+        {
+            const auto band_minzoom = minzoom(*first);
+            const auto last = std::find_if(first, items.end(), [&](const T &item) { return minzoom(item) != band_minzoom; });
+
+            band_items.assign(first, last);
+            bands.emplace_back();
+            bands.back().minzoom = band_minzoom;
+            bands.back().first = static_cast<std::uint32_t>(first - items.begin());
+            bands.back().index.build(band_items, indexable, num_threads);
+            std::copy(band_items.begin(), band_items.end(), first);
+
+            first = last;
+        }
+    }
+
+    // Appends the ranges of items in bands visible at zoom z whose leaves
+    // intersect box
+    void query(const world_box_t &box, const int z, std::vector<PackedIndex::range_t> &ranges, std::vector<std::uint32_t> &stack) const
+    {
+        for (const auto &band : bands)
+        {
+            if (band.minzoom > z) break;
+            band.index.query(box, ranges, stack, band.first);
+        }
+    }
+
+    std::size_t size() const
+    {
+        std::size_t result = 0;
+        for (const auto &band : bands) result += band.index.size();
+        return result;
+    }
+
+    std::size_t memory() const
+    {
+        std::size_t result = 0;
+        for (const auto &band : bands) result += band.index.memory();
+        return result;
+    }
+
+    std::size_t numBands() const { return bands.size(); }
+
+    // Writes each band's minzoom and first item, then its tree, to a snapshot
+    void save(snapshot::Writer &writer, const std::string &name) const
+    {
+        std::vector<std::uint32_t> band_table;
+        for (const auto &band : bands)
+        {
+            band_table.push_back(band.minzoom);
+            band_table.push_back(band.first);
+        }
+        writer.add(name + ".bands", band_table);
+        for (std::size_t i = 0; i < bands.size(); ++i) bands[i].index.save(writer, name + "." + std::to_string(i));
+    }
+
+    void load(const snapshot::Reader &reader, const std::string &name)
+    {
+        const auto band_table = reader.array<std::uint32_t>(name + ".bands");
+        bands.clear();
+        bands.resize(band_table.size() / 2);
+        for (std::size_t i = 0; i < bands.size(); ++i)
+        {
+            bands[i].minzoom = static_cast<std::uint8_t>(band_table[i * 2]);
+            bands[i].first = band_table[i * 2 + 1];
+            bands[i].index.load(reader, name + "." + std::to_string(i));
+        }
+    }
+
+  private:
+    struct band_t {
+        std::uint8_t minzoom;
+        // Offset of the band's first item in the items array
+        std::uint32_t first;
+        PackedIndex index;
+    };
+
+    // Ascending minzoom
+    std::vector<band_t> bands;
+};
+
+}
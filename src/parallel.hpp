@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+/**
+ * Calls f(first, last) for num_threads ranges that together cover [0, count),
+ * each on its own thread, the last on the calling thread.  Ranges are cut at
+ * multiples of grain, and there are fewer of them if count is small, so
+ * threads are only started when there's work for them.
+ **/
+template <typename F> void parallelFor(const std::size_t count, std::size_t num_threads, F f, const std::size_t grain = 1)
+{
+    const auto units = (count + grain - 1) / grain;
+    num_threads = std::max<std::size_t>(1, std::min(num_threads, units));
+    if (num_threads == 1)
+    {
+        if (count > 0) f(std::size_t{0}, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        const auto first = std::min(count, units * i / num_threads * grain);
+        const auto last = std::min(count, units * (i + 1) / num_threads * grain);
+        if (i + 1 == num_threads) f(first, last);
+        else threads.emplace_back([&f, first, last]() { f(first, last); });
+    }
+    for (auto &thread : threads) thread.join();
+}
+
+/**
+ * Sorts [first, last) like std::stable_sort, on num_threads threads.  Each
+ * thread stable sorts a slice, then neighbouring slices are merged in rounds,
+ * each merge keeping the left slice's elements first among equals.  The
+ * result is exactly what std::stable_sort gives, however many threads there
+ * are, so anything built from it comes out the same on any machine.
+ *
+ * Small ranges aren't worth the threads and are sorted in place.  The last
+ * merge runs on one thread, which bounds the speedup on very many cores.
+ **/
+template <typename Iterator, typename Compare>
+void parallelStableSort(const Iterator first, const Iterator last, Compare compare, const std::size_t num_threads)
+{
+    static const constexpr std::size_t MIN_SLICE = 1 << 15;
+    const auto count = static_cast<std::size_t>(std::distance(first, last));
+    const auto slices = std::max<std::size_t>(1, std::min(num_threads, count / MIN_SLICE));
+    if (slices == 1)
+    {
+        std::stable_sort(first, last, compare);
+        return;
+    }
+
+    std::vector<std::size_t> bounds(slices + 1);
+    for (std::size_t i = 0; i <= slices; ++i) bounds[i] = count * i / slices;
+
+    parallelFor(slices, slices, [&](const std::size_t begin, const std::size_t end) {
+        for (auto i = begin; i < end; ++i) std::stable_sort(first + bounds[i], first + bounds[i + 1], compare);
+    });
+
+    for (std::size_t width = 1; width < slices; width *= 2)
+    {
+        const auto merges = (slices + 2 * width - 1) / (2 * width);
+        parallelFor(merges, merges, [&](const std::size_t begin, const std::size_t end) {
+            for (auto merge = begin; merge < end; ++merge)
+            {
+                const auto left = merge * 2 * width;
+                const auto middle = left + width;
+                if (middle >= slices) continue;
+                const auto right = std::min(slices, middle + width);
+                std::inplace_merge(first + bounds[left], first + bounds[middle], first + bounds[right], compare);
+            }
+        });
+    }
+}
+
+}
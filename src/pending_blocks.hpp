@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * The blocks of tiles being rendered, with whoever is waiting for each.
+ *
+ * Map clients ask for neighbouring tiles in bursts, so several misses in one
+ * block usually arrive while it's still rendering.  The first one starts the
+ * render, and the rest just wait for it rather than each rendering the whole
+ * block again.  Blocks are keyed by the speed generation they were asked for
+ * in as well, so a request made after an update never waits for a render
+ * that may have started from the speeds before it.
+ **/
+template <typename Waiter> class PendingBlocks {
+  public:
+    struct key_t {
+        int x;
+        int y;
+        int z;
+        std::uint64_t generation;
+
+        bool operator<(const key_t &other) const { return std::tie(x, y, z, generation) < std::tie(other.x, other.y, other.z, other.generation); }
+    };
+
+    PendingBlocks() = default;
+    PendingBlocks(const PendingBlocks &) = delete;
+    PendingBlocks &operator=(const PendingBlocks &) = delete;
+
+    // Adds waiter to the block, and returns true if it wasn't pending yet,
+    // in which case the caller renders it and then calls finish
+    bool join(const key_t &block, Waiter waiter)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &waiters = blocks[block];
+        waiters.push_back(std::move(waiter));
+        return waiters.size() == 1;
+    }
+
+    // Forgets the block, and returns everyone who was waiting for it
+    std::vector<Waiter> finish(const key_t &block)
+    {
+        std::vector<Waiter> waiters;
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = blocks.find(block);
+        if (found == blocks.end()) return waiters;
+        waiters.swap(found->second);
+        blocks.erase(found);
+        return waiters;
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return blocks.size();
+    }
+
+  private:
+    mutable std::mutex mutex;
+    std::map<key_t, std::vector<Waiter>> blocks;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTIL_PROJECTION_X86
+#endif
+
+#include "web_mercator.hpp"
+
+namespace util { namespace web_mercator {
+
+namespace detail {
+// Size of the world grid, and the largest coordinate on it
+const constexpr double WORLD_SIZE = static_cast<double>(std::uint64_t{1} << WORLD_BITS);
+const constexpr double WORLD_MAX = WORLD_SIZE - 1;
+
+// Rounds a scaled world position onto the grid.  Clamping first keeps every
+// value non-negative, so adding a half and truncating rounds like
+// fractionToWorld's std::round does.
+inline std::uint32_t scaledToWorld(const double scaled)
+{
+    return static_cast<std::uint32_t>(std::max(0., std::min(WORLD_MAX, scaled)) + 0.5);
+}
+
+inline std::uint32_t latToWorldYExact(const double lat)
+{
+    return scaledToWorld((0.5 - latToY(lat) / 360.) * WORLD_SIZE);
+}
+
+typedef void (*project_kernel_t)(const double *lons, const double *lats, std::size_t count,
+                                 std::uint32_t *xs, std::uint32_t *ys);
+
+// The reference kernel, which the vector ones below reproduce bit for bit:
+// every operation is done in the same order, without fused multiply-adds.
+inline void projectScalar(const double *lons, const double *lats, const std::size_t count,
+                          std::uint32_t *xs, std::uint32_t *ys)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        xs[i] = scaledToWorld((0.5 + lons[i] / 360.) * WORLD_SIZE);
+        ys[i] = scaledToWorld((0.5 - latToYapprox(lats[i]) / 360.) * WORLD_SIZE);
+    }
+}
+
+#ifdef UTIL_PROJECTION_X86
+// Each kernel does the part of the batch that fills whole vectors, working
+// out latitudes with the approximant.  Lanes outside the approximant's range
+// are redone with latToY afterwards, and the tail goes to projectScalar.
+
+__attribute__((target("avx2"))) inline __m128i scaledToWorldAVX2(const __m256d scaled)
+{
+    const __m256d clamped = _mm256_min_pd(_mm256_set1_pd(WORLD_MAX), _mm256_max_pd(_mm256_setzero_pd(), scaled));
+    const __m256d rounded = _mm256_round_pd(_mm256_add_pd(clamped, _mm256_set1_pd(0.5)), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    // There's no unsigned conversion, so shift into int32 range and flip the sign bit back
+    const __m128i biased = _mm256_cvttpd_epi32(_mm256_sub_pd(rounded, _mm256_set1_pd(2147483648.)));
+    return _mm_xor_si128(biased, _mm_set1_epi32(static_cast<int>(0x80000000u)));
+}
+
+__attribute__((target("avx2"))) inline void projectAVX2(const double *lons, const double *lats, const std::size_t count,
+                                                          std::uint32_t *xs, std::uint32_t *ys)
+{
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d degrees = _mm256_set1_pd(360.);
+    const __m256d size = _mm256_set1_pd(WORLD_SIZE);
+    const __m256d min_lat = _mm256_set1_pd(-LAT_TO_Y_APPROX_LIMIT);
+    const __m256d max_lat = _mm256_set1_pd(LAT_TO_Y_APPROX_LIMIT);
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m256d lon = _mm256_loadu_pd(lons + i);
+        const __m256d x = _mm256_mul_pd(_mm256_add_pd(half, _mm256_div_pd(lon, degrees)), size);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(xs + i), scaledToWorldAVX2(x));
+
+        const __m256d lat = _mm256_loadu_pd(lats + i);
+        __m256d numerator = _mm256_set1_pd(LAT_TO_Y_NUMERATOR[LAT_TO_Y_APPROX_TERMS - 1]);
+        __m256d denominator = _mm256_set1_pd(LAT_TO_Y_DENOMINATOR[LAT_TO_Y_APPROX_TERMS - 1]);
+        for (std::size_t k = LAT_TO_Y_APPROX_TERMS - 1; k > 0; --k)
+        {
+            numerator = _mm256_add_pd(_mm256_mul_pd(numerator, lat), _mm256_set1_pd(LAT_TO_Y_NUMERATOR[k - 1]));
+            denominator = _mm256_add_pd(_mm256_mul_pd(denominator, lat), _mm256_set1_pd(LAT_TO_Y_DENOMINATOR[k - 1]));
+        }
+        const __m256d y = _mm256_mul_pd(_mm256_sub_pd(half, _mm256_div_pd(_mm256_div_pd(numerator, denominator), degrees)), size);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ys + i), scaledToWorldAVX2(y));
+
+        const int outside = _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(lat, min_lat, _CMP_LT_OQ),
+                                                             _mm256_cmp_pd(lat, max_lat, _CMP_GT_OQ)));
+        for (int lane = 0; outside != 0 && lane < 4; ++lane)
+        {
+            if (outside & (1 << lane)) ys[i + lane] = latToWorldYExact(lats[i + lane]);
+        }
+    }
+    projectScalar(lons + i, lats + i, count - i, xs + i, ys + i);
+}
+
+__attribute__((target("sse4.1"))) inline __m128i scaledToWorldSSE4(const __m128d scaled)
+{
+    const __m128d clamped = _mm_min_pd(_mm_set1_pd(WORLD_MAX), _mm_max_pd(_mm_setzero_pd(), scaled));
+    const __m128d rounded = _mm_round_pd(_mm_add_pd(clamped, _mm_set1_pd(0.5)), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    const __m128i biased = _mm_cvttpd_epi32(_mm_sub_pd(rounded, _mm_set1_pd(2147483648.)));
+    return _mm_xor_si128(biased, _mm_set1_epi32(static_cast<int>(0x80000000u)));
+}
+
+__attribute__((target("sse4.1"))) inline void projectSSE4(const double *lons, const double *lats, const std::size_t count,
+                                                            std::uint32_t *xs, std::uint32_t *ys)
+{
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d degrees = _mm_set1_pd(360.);
+    const __m128d size = _mm_set1_pd(WORLD_SIZE);
+    const __m128d min_lat = _mm_set1_pd(-LAT_TO_Y_APPROX_LIMIT);
+    const __m128d max_lat = _mm_set1_pd(LAT_TO_Y_APPROX_LIMIT);
+
+    std::size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        const __m128d lon = _mm_loadu_pd(lons + i);
+        const __m128d x = _mm_mul_pd(_mm_add_pd(half, _mm_div_pd(lon, degrees)), size);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(xs + i), scaledToWorldSSE4(x));
+
+        const __m128d lat = _mm_loadu_pd(lats + i);
+        __m128d numerator = _mm_set1_pd(LAT_TO_Y_NUMERATOR[LAT_TO_Y_APPROX_TERMS - 1]);
+        __m128d denominator = _mm_set1_pd(LAT_TO_Y_DENOMINATOR[LAT_TO_Y_APPROX_TERMS - 1]);
+        for (std::size_t k = LAT_TO_Y_APPROX_TERMS - 1; k > 0; --k)
+        {
+            numerator = _mm_add_pd(_mm_mul_pd(numerator, lat), _mm_set1_pd(LAT_TO_Y_NUMERATOR[k - 1]));
+            denominator = _mm_add_pd(_mm_mul_pd(denominator, lat), _mm_set1_pd(LAT_TO_Y_DENOMINATOR[k - 1]));
+        }
+        const __m128d y = _mm_mul_pd(_mm_sub_pd(half, _mm_div_pd(_mm_div_pd(numerator, denominator), degrees)), size);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(ys + i), scaledToWorldSSE4(y));
+
+        const int outside = _mm_movemask_pd(_mm_or_pd(_mm_cmplt_pd(lat, min_lat), _mm_cmpgt_pd(lat, max_lat)));
+        if (outside & 1) ys[i] = latToWorldYExact(lats[i]);
+        if (outside & 2) ys[i + 1] = latToWorldYExact(lats[i + 1]);
+    }
+    projectScalar(lons + i, lats + i, count - i, xs + i, ys + i);
+}
+#endif
+
+// The widest kernel this CPU can run
+inline project_kernel_t selectKernel()
+{
+#ifdef UTIL_PROJECTION_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return projectAVX2;
+    if (__builtin_cpu_supports("sse4.1")) return projectSSE4;
+#endif
+    return projectScalar;
+}
+}
+
+/**
+ * Projects a batch of WGS84 coordinates, given as separate longitude and
+ * latitude arrays, onto the world grid.  Latitudes use the latToYapprox
+ * approximant, so results can differ from latToWorldY by one grid unit.
+ * The kernel is picked for the CPU on first use.
+ **/
+inline void projectToWorld(const double *lons, const double *lats, const std::size_t count,
+                           std::uint32_t *xs, std::uint32_t *ys)
+{
+    static const detail::project_kernel_t kernel = detail::selectKernel();
+    kernel(lons, lats, count, xs, ys);
+}
+
+} }
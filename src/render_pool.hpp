@@ -0,0 +1,88 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of render threads fed from a bounded queue.
+ *
+ * Every worker owns one `Scratch` object for its whole lifetime and hands it
+ * to each job it runs, so the buffers used while rendering a tile keep their
+ * capacity from one request to the next.  When `max_queued` jobs are already
+ * waiting, `submit` refuses new work instead of letting the backlog grow, so
+ * the caller can fail fast rather than queue requests it can't serve in time.
+ */
+template <typename Scratch> class RenderPool {
+  public:
+    typedef std::function<void(Scratch &)> job_t;
+
+    RenderPool(std::size_t num_threads, std::size_t max_queued) : max_queued(max_queued), stopping(false)
+    {
+        if (num_threads == 0) num_threads = 1;
+        workers.reserve(num_threads);
+        for (std::size_t i = 0; i < num_threads; ++i)
+        {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    RenderPool(const RenderPool &) = delete;
+    RenderPool &operator=(const RenderPool &) = delete;
+
+    ~RenderPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    // Returns false if the queue is full (or the pool is shutting down) and the job was not accepted
+    bool submit(job_t job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || queue.size() >= max_queued) return false;
+            queue.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    std::size_t size() const { return workers.size(); }
+
+  private:
+    void run()
+    {
+        Scratch scratch;
+        for (;;)
+        {
+            job_t job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            job(scratch);
+        }
+    }
+
+    const std::size_t max_queued;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<job_t> queue;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+namespace util {
+
+// A kind of road, by the value of its highway tag
+struct road_class_t {
+    std::string name;
+    // The lowest zoom it's drawn at
+    std::uint8_t minzoom;
+    // Which ways it runs when the way has no oneway tag
+    ValidDirections directions;
+};
+
+/**
+ * Finds the road class of a highway tag value with a perfect hash: each
+ * class name has a slot of its own in a table indexed by a seeded FNV-1a
+ * hash of the name, so a lookup is one pass over the value to hash it and
+ * one comparison against the only name it could be.
+ *
+ * The table has at least as many slots as the square of the number of
+ * classes, which makes a seed with no collisions quick to find, and is
+ * still only a few KB for any sensible number of classes.
+ **/
+class RoadClasses {
+  public:
+    typedef std::uint8_t class_id_t;
+    static const constexpr class_id_t NONE = 255;
+
+    explicit RoadClasses(std::vector<road_class_t> classes_) : classes(std::move(classes_)), seed(0), mask(0)
+    {
+        if (classes.size() >= NONE) throw std::invalid_argument("at most 254 road classes are supported");
+        for (std::size_t i = 0; i < classes.size(); ++i)
+        {
+            for (std::size_t j = 0; j < i; ++j)
+            {
+                if (classes[i].name == classes[j].name) throw std::invalid_argument("road class " + classes[i].name + " is given twice");
+            }
+        }
+
+        std::size_t size = 8;
+        while (size < classes.size() * classes.size()) size *= 2;
+        mask = static_cast<std::uint32_t>(size - 1);
+        for (seed = 1; seed < MAX_SEEDS; ++seed)
+        {
+            slots.assign(size, class_id_t{NONE});
+            bool collided = false;
+            for (std::size_t i = 0; i < classes.size() && !collided; ++i)
+            {
+                auto &slot = slots[hash(classes[i].name.c_str()) & mask];
+                collided = slot != NONE;
+                slot = static_cast<class_id_t>(i);
+            }
+            if (!collided) return;
+        }
+        throw std::invalid_argument("couldn't find a perfect hash for the road classes");
+    }
+
+    // The classes that used to be hard coded, which config.yaml also lists
+    static RoadClasses defaults()
+    {
+        return RoadClasses({{"motorway", 4, Forward},
+                            {"trunk", 9, Both},
+                            {"primary", 9, Both},
+                            {"motorway_link", 11, Both},
+                            {"trunk_link", 11, Both},
+                            {"primary_link", 11, Both},
+                            {"secondary", 13, Both},
+                            {"secondary_link", 13, Both},
+                            {"tertiary", 14, Both},
+                            {"tertiary_link", 14, Both},
+                            {"residential", 15, Both},
+                            {"living_street", 15, Both},
+                            {"service", 16, Both},
+                            {"unclassified", 16, Both}});
+    }
+
+    // The class named value, or NONE if it isn't a road we load
+    class_id_t find(const char *value) const
+    {
+        const auto id = slots[hash(value) & mask];
+        if (id == NONE || std::strcmp(classes[id].name.c_str(), value) != 0) return NONE;
+        return id;
+    }
+
+    const road_class_t &operator[](const class_id_t id) const { return classes[id]; }
+    std::size_t size() const { return classes.size(); }
+
+  private:
+    static const constexpr std::uint32_t MAX_SEEDS = 100000;
+
+    std::uint32_t hash(const char *value) const
+    {
+        std::uint32_t result = 2166136261u ^ seed;
+        for (; *value != '\0'; ++value) result = (result ^ static_cast<std::uint8_t>(*value)) * 16777619u;
+        // FNV's low bits mix poorly, and they're the ones the mask keeps
+        return result ^ (result >> 16);
+    }
+
+    std::vector<road_class_t> classes;
+    std::vector<class_id_t> slots;
+    std::uint32_t seed;
+    std::uint32_t mask;
+};
+
+}
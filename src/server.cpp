@@ -1,15 +1,13 @@
 #include <osmium/osm.hpp>
 #include <osmium/osm/types.hpp>
 #include <osmium/osm/location.hpp>
-#include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/handler.hpp>
-#include <osmium/index/map/all.hpp>
 
 #include <osmium/io/pbf_input.hpp> // IWYU pragma: export
 #include <osmium/io/xml_input.hpp> // IWYU pragma: export
 #include <osmium/io/o5m_input.hpp> // IWYU pragma: export
 #include <osmium/io/file.hpp>
-#include <osmium/visitor.hpp>
+#include <osmium/memory/buffer.hpp>
 
 #include <boost/timer/timer.hpp>
 
@@ -17,7 +15,6 @@
 #include <boost/filesystem.hpp>
 
 #include <boost/geometry.hpp>
-#include <boost/geometry/index/rtree.hpp>
 
 
 #include <unordered_map>
@@ -25,296 +22,971 @@
 #include <cstdio>
 #include <cstring>
 #include <cinttypes>
+#include <limits>
+#include <numeric>
+#include <iterator>
+#include <chrono>
 
 #include "common.hpp"
 #include "server_http.hpp"
 #include "vector_tile.hpp"
 #include "web_mercator.hpp"
+#include "projection.hpp"
 #include "tile.hpp"
 #include "merge.hpp"
+#include "simplify.hpp"
+#include "render_pool.hpp"
+#include "packed_index.hpp"
+#include "tile_cache.hpp"
+#include "pending_blocks.hpp"
+#include "speeds.hpp"
+#include "speed_store.hpp"
+#include "speed_bins.hpp"
+#include "dirty_tiles.hpp"
+#include "array.hpp"
+#include "snapshot.hpp"
+#include "parallel.hpp"
+#include "node_locations.hpp"
+#include "road_classes.hpp"
+#include "config.hpp"
 
 
 
-typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type, osmium::Location> index_neg_type;
-typedef osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type, osmium::Location> index_pos_type;
-//typedef osmium::index::map::DenseMemArray<osmium::unsigned_object_id_type, osmium::Location> index_pos_type;
-typedef osmium::handler::NodeLocationsForWays<index_pos_type, index_neg_type> location_handler_type;
-
 typedef SimpleWeb::Server<SimpleWeb::HTTP> HttpServer;
 
 void usage(char* name) {
-    std::cerr << "Usage: " << name << " <map.pbf> <freeflow.csv> <current.csv>" << std::endl;
+    std::cerr << "Usage: " << name << " <map.pbf|map.snapshot> <freeflow.csv> <current.csv> [config.yaml]" << std::endl;
+    std::cerr << "       " << name << " build <map.pbf> <map.snapshot> [config.yaml]" << std::endl;
     std::cerr << std::endl;
     std::cerr << "Starts up a tileserver that can generate traffic vector tiles." << std::endl;
     std::cerr << "  map.pbf  - the map you want to serve tiles from" << std::endl;
+    std::cerr << "  map.snapshot  - the same map, prepared by build, which starts in seconds" << std::endl;
     std::cerr << "  freeflow.csv  - A CSV file containing nodeA,nodeB,speed with the free flow speeds of roads " << std::endl;
     std::cerr << "  current.csv  - A CSV file containing nodeA,nodeB,speed with the current speeds of roads " << std::endl;
-    std::cerr << "  config.yaml  - A simple configuration file that defines join thresholds and road heirarchies" << std::endl;
+    std::cerr << "  config.yaml  - the road classes to load and the speed bins to draw, see the one in the repository" << std::endl;
 
 }
 
+/**
+ * Cuts ways into chunks.  Several of these run at once during ingest, each
+ * on its own thread and with its own output vectors, looking up node
+ * locations in the shared store, which is only read by then.
+ **/
 struct Extractor final : osmium::handler::Handler {
 
-    std::vector<rtree_value_t> &segments;
+    std::vector<chunk_t> &chunks;
+    std::vector<world_point_t> &points;
+    // OSM node ids of each edge, indexed by edge id
+    std::vector<nodepair_t> &edges;
+    const util::NodeLocations &node_locations;
+    const util::RoadClasses &road_classes;
     const boost::geometry::strategy::distance::haversine<double> haversine;
 
-    Extractor (std::vector<rtree_value_t> & segments_) : segments(segments_), haversine(util::web_mercator::detail::EARTH_RADIUS_WGS84) {}
+    // Locations of the current way's nodes, invalid where a node is missing
+    std::vector<osmium::Location> locations;
+    // Node coordinates of the current way, projected in one batch
+    std::vector<double> lons;
+    std::vector<double> lats;
+    std::vector<std::uint32_t> xs;
+    std::vector<std::uint32_t> ys;
+
+    // The chunk being built
+    chunk_t chunk;
+
+    Extractor (std::vector<chunk_t> & chunks_, std::vector<world_point_t> & points_, std::vector<nodepair_t> & edges_, const util::NodeLocations & node_locations_, const util::RoadClasses & road_classes_) : chunks(chunks_), points(points_), edges(edges_), node_locations(node_locations_), road_classes(road_classes_), haversine(util::web_mercator::detail::EARTH_RADIUS_WGS84) {}
 
-    static const bool usable(const osmium::Way &way)
+    // Nodes missing from the file, like those outside an extract, have no
+    // location, and the way is cut where they are
+    osmium::Location locate(const osmium::object_id_type ref) const
     {
-        const char *highway = way.tags().get_value_by_key("highway");
-        // Check to see if it's an interesting type of way.  We're only
-        // interested in roads at the moment.
-        return highway != nullptr &&
-            (std::strcmp(highway, "motorway") == 0 || std::strcmp(highway, "motorway_link") == 0 ||
-             std::strcmp(highway, "trunk") == 0 || std::strcmp(highway, "trunk_link") == 0 ||
-             std::strcmp(highway, "primary") == 0 || std::strcmp(highway, "primary_link") == 0 ||
-             std::strcmp(highway, "secondary") == 0 || std::strcmp(highway, "secondary_link") == 0 ||
-             std::strcmp(highway, "tertiary") == 0 || std::strcmp(highway, "tertiary_link") == 0 ||
-             std::strcmp(highway, "residential") == 0 || std::strcmp(highway, "living_street") == 0 ||
-             std::strcmp(highway, "unclassified") == 0 || std::strcmp(highway, "service") == 0 ||
-             std::strcmp(highway, "ferry") == 0 || std::strcmp(highway, "movable") == 0 ||
-             std::strcmp(highway, "shuttle_train") == 0 || std::strcmp(highway, "default") == 0);
+        std::int32_t x, y;
+        if (ref < 0 || !node_locations.get(static_cast<std::uint64_t>(ref), x, y)) return osmium::Location();
+        // Missing nodes are stored with osmium's undefined coordinates
+        return osmium::Location(x, y);
     }
 
-    static const int get_minzoom(const osmium::Way &way) {
+    // The way's road class, or NONE if it isn't drawn, and which ways it
+    // runs: as tagged, or as the class runs by default without a oneway tag
+    static util::RoadClasses::class_id_t classify(const util::RoadClasses &road_classes, const osmium::Way &way, bool &forward, bool &reverse) {
         const char *highway = way.tags().get_value_by_key("highway");
-        if (highway == nullptr) return -1;
-        if ( std::strcmp(highway, "motorway") == 0 ) return 4;
-        if ( std::strcmp(highway, "trunk") == 0 || std::strcmp(highway, "primary") == 0 ) return 9;
-        if ( std::strcmp(highway, "primary_link") == 0 || std::strcmp(highway, "motorway_link") == 0 || std::strcmp(highway, "trunk_link") == 0) return 11;
-        if ( std::strcmp(highway, "secondary") == 0 || std::strcmp(highway, "secondary_link") == 0) return 13;
-        if ( std::strcmp(highway, "tertiary") == 0 || std::strcmp(highway, "tertiary_link") == 0) return 14;
-        if ( std::strcmp(highway, "residential") == 0 || std::strcmp(highway, "living_street") == 0) return 15;
-        if ( std::strcmp(highway, "service") == 0 || std::strcmp(highway, "unclassified") == 0) return 16;
-        return -1;
+        if (highway == nullptr || way.nodes().size() < 2) return util::RoadClasses::NONE;
+        const auto id = road_classes.find(highway);
+        if (id == util::RoadClasses::NONE) return id;
+
+        const char *oneway = way.tags().get_value_by_key("oneway");
+        if (oneway) {
+            forward = (std::strcmp(oneway, "yes") == 0 || std::strcmp(oneway, "no") == 0);
+            reverse = (std::strcmp(oneway, "-1") == 0 || std::strcmp(oneway, "no") == 0);
+        } else {
+            const auto directions = road_classes[id].directions;
+            forward = directions != Reverse;
+            reverse = directions != Forward;
+        }
+        if (!forward && !reverse) return util::RoadClasses::NONE;
+        return id;
     }
 
     void way(const osmium::Way& way) {
 
-        // Figure out which directions we need to process
-        const char *oneway = way.tags().get_value_by_key("oneway");
-        bool forward = (!oneway || std::strcmp(oneway, "yes") == 0 || std::strcmp(oneway, "no") == 0);
-        bool reverse = (!oneway || std::strcmp(oneway, "-1") == 0 || std::strcmp(oneway, "no") == 0);
+        bool forward, reverse;
+        const auto road_class = classify(road_classes, way, forward, reverse);
+        if (road_class != util::RoadClasses::NONE)
+        {
+            const auto minzoom = road_classes[road_class].minzoom;
+            const auto s = way.nodes().size();
 
-        // Check for implied oneway on motorways when it's not specified
-        if (!oneway) {
-            const char *highway = way.tags().get_value_by_key("highway");
-            if (highway && std::strcmp(highway,"motorway") == 0)
+            // Project into world coordinates once, here, so rendering
+            // a tile doesn't need any trigonometry
+            locations.resize(s);
+            lons.resize(s);
+            lats.resize(s);
+            xs.resize(s);
+            ys.resize(s);
+            for (std::remove_const_t<decltype(s)> i{0}; i<s; ++i)
             {
-                forward = true;
-                reverse = false;
+                const auto &location = locations[i] = locate(way.nodes()[i].ref());
+                lons[i] = location.valid() ? location.lon() : 0.;
+                lats[i] = location.valid() ? location.lat() : 0.;
             }
-        }
+            util::web_mercator::projectToWorld(lons.data(), lats.data(), s, xs.data(), ys.data());
 
-        const auto minzoom = get_minzoom(way);
-
-        if (minzoom > -1 && way.nodes().size() > 1 && (forward || reverse))
-        {
-            const auto s = way.nodes().size();
-            for (std::remove_const_t<decltype(s)> i{0}; i<s-1; ++i)
+            // Cut the way into chunks of consecutive segments, starting a
+            // new one at invalid noderefs, and when a chunk is full
+            bool open = false;
+            std::remove_const_t<decltype(s)> last{0};
+            for (std::remove_const_t<decltype(s)> i{0}; i<s; ++i)
             {
-                const auto a = way.nodes()[i];
-                const auto b = way.nodes()[i+1];
+                const auto &node = way.nodes()[i];
+                if (!locations[i].valid())
+                {
+                    closeChunk();
+                    open = false;
+                    continue;
+                }
 
-                // Throw out self-loops and invalid noderefs
-                if (a.ref() == b.ref()) continue;
-                if (!a.location().valid()) continue;
-                if (!b.location().valid()) continue;
+                if (!open)
+                {
+                    startChunk(xs[i], ys[i], minzoom);
+                    open = true;
+                    last = i;
+                    continue;
+                }
 
-                segments.push_back({wgs84_segment_t{{ a.location().lon(), a.location().lat(), minzoom }, { b.location().lon(), b.location().lat(), minzoom }}, {a.ref(), b.ref()}});
+                // Throw out self-loops
+                if (node.ref() == way.nodes()[last].ref()) continue;
 
+                if (chunk.num_points == chunk_t::MAX_POINTS)
+                {
+                    closeChunk();
+                    startChunk(xs[last], ys[last], minzoom);
+                }
+                addPoint(xs[i], ys[i]);
+                edges.emplace_back(way.nodes()[last].ref(), node.ref());
+                last = i;
             }
+            closeChunk();
         }
 
     }
+
+    void startChunk(const std::uint32_t x, const std::uint32_t y, const int minzoom)
+    {
+        chunk.min_x = chunk.max_x = x;
+        chunk.min_y = chunk.max_y = y;
+        chunk.first_point = static_cast<std::uint32_t>(points.size());
+        chunk.first_edge = static_cast<edge_id_t>(edges.size());
+        chunk.num_points = 0;
+        chunk.minzoom = static_cast<std::uint8_t>(minzoom);
+        addPoint(x, y);
+    }
+
+    void addPoint(const std::uint32_t x, const std::uint32_t y)
+    {
+        points.emplace_back(x, y);
+        chunk.min_x = std::min(chunk.min_x, x);
+        chunk.min_y = std::min(chunk.min_y, y);
+        chunk.max_x = std::max(chunk.max_x, x);
+        chunk.max_y = std::max(chunk.max_y, y);
+        ++chunk.num_points;
+    }
+
+    // Keeps the chunk if it got as far as a segment, and drops its lone
+    // point if not
+    void closeChunk()
+    {
+        if (chunk.num_points > 1) chunks.push_back(chunk);
+        else if (chunk.num_points == 1) points.pop_back();
+        chunk.num_points = 0;
+    }
 };
 
-int main(int argc, char* argv[])
+// A speed bin without a value in the tile's layer yet
+static const constexpr std::uint32_t NO_VALUE = std::numeric_limits<std::uint32_t>::max();
+
+/**
+ * Buffers used while rendering a tile, or a metatile of several.  Each
+ * render worker keeps one of these for its lifetime, so the vectors, the
+ * mergers and the output buffers retain their capacity between requests
+ * instead of being reallocated.  This is the worker's arena: everything is
+ * cleared, never freed, at the start of a render, so once a worker has
+ * rendered a busy one, rendering allocates nothing but the buffers of the
+ * encoded tiles, which are handed to responses and the cache.
+ **/
+struct RenderScratch {
+    std::vector<util::PackedIndex::range_t> ranges;
+    std::vector<std::uint32_t> stack;
+    // A chunk's points on the pixel grid of the top left tile
+    std::vector<util::tile::tile_point_t> projected;
+    // Runs of a chunk's segments in one speed bin left after clipping
+    util::tile::tile_linestring_t run;
+    // One per speed bin per tile, so only lines in the same bin on the same
+    // tile are joined.  Never shrunk, so a smaller render keeps the rest.
+    std::vector<LineMerger> mergers;
+    // Index of each bin's name in the layer's values, NO_VALUE until a
+    // feature in that bin is written, and the bins in value order
+    std::vector<std::uint32_t> bin_values;
+    std::vector<util::speeds::SpeedBins::bin_t> used_bins;
+    // Each merged line in turn, while it's simplified and encoded
+    util::tile::tile_linestring_t tile_line;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> simplify_stack;
+    std::vector<std::uint8_t> simplify_keep;
+    // One encoded tile per tile rendered, row by row
+    std::vector<std::string> pbf_buffers;
+};
+
+typedef RenderPool<RenderScratch> render_pool_t;
+
+// Buffers the update thread keeps from one speed update to the next
+struct UpdateScratch {
+    std::vector<util::speeds::update_t> updates;
+    // Edges whose speed bin changed
+    std::vector<edge_id_t> changed;
+};
+
+typedef RenderPool<UpdateScratch> update_pool_t;
+
+// A tile request waiting for the block it's in to be rendered
+struct TileWaiter {
+    std::shared_ptr<HttpServer::Response> response;
+    int x;
+    int y;
+};
+
+typedef PendingBlocks<TileWaiter> pending_blocks_t;
+
+// Everything but the Content-Length of a tile response, which is added per tile
+static const char TILE_RESPONSE_HEADER[] = "HTTP/1.1 200 OK\r\n"
+                                           "Content-Type: application/vnd.mapbox-vector-tile\r\n"
+                                           "Access-Control-Allow-Origin: *\r\n";
+static const char BUNDLE_RESPONSE_HEADER[] = "HTTP/1.1 200 OK\r\n"
+                                             "Content-Type: application/x-protobuf\r\n"
+                                             "Access-Control-Allow-Origin: *\r\n";
+
+// A /metatile bundle is a protobuf message of repeated tiles, each with its
+// x, y and z and the encoded vector tile
+static const constexpr protozero::pbf_tag_type BUNDLE_TILE_TAG = 1;
+static const constexpr protozero::pbf_tag_type BUNDLE_X_TAG = 1;
+static const constexpr protozero::pbf_tag_type BUNDLE_Y_TAG = 2;
+static const constexpr protozero::pbf_tag_type BUNDLE_Z_TAG = 3;
+static const constexpr protozero::pbf_tag_type BUNDLE_DATA_TAG = 4;
+
+// The road chunks, in the order the spatial index sorted them into, and the
+// points they refer to.  Built from a map file, or used in place from a
+// mapped snapshot.
+struct RoadIndex {
+    util::Array<chunk_t> chunks;
+    util::Array<world_point_t> points;
+    util::ZoomIndex index;
+    // Indices into chunks, by first_edge, to find the chunk holding an edge
+    util::Array<std::uint32_t> chunks_by_edge;
+
+    void save(util::snapshot::Writer &writer) const
+    {
+        writer.add("roads.chunks", chunks);
+        writer.add("roads.points", points);
+        writer.add("roads.chunks_by_edge", chunks_by_edge);
+        index.save(writer, "roads.index");
+    }
+
+    void load(const util::snapshot::Reader &reader)
+    {
+        chunks = reader.array<chunk_t>("roads.chunks");
+        points = reader.array<world_point_t>("roads.points");
+        chunks_by_edge = reader.array<std::uint32_t>("roads.chunks_by_edge");
+        index.load(reader, "roads.index");
+    }
+};
+
+// Reads the roads of road_classes out of an OSM file, indexes them, and
+// builds the lookup from node pairs to edges, all on num_threads threads
+void buildRoads(const char *path, const util::RoadClasses &road_classes, RoadIndex &roads, util::EdgeLookup &edge_lookup, const std::size_t num_threads)
 {
-    std::shared_ptr<line_rtree_t> rtree_ptr;
+    std::vector<chunk_t> chunks;
+    std::vector<world_point_t> points;
+    std::vector<nodepair_t> edges;
 
-    std::cerr << "Parsing " << argv[1] << std::endl;
-    try
+    osmium::io::File pbfFile{path};
+
+    // Only the nodes of ways that are drawn need a location, which is a
+    // small part of all of them, so a first pass over the ways finds those
+    // nodes, and the second stores just their locations
+    util::NodeIdSet node_ids;
     {
-        std::vector<rtree_value_t> segments;
-
-        osmium::io::File pbfFile{argv[1]};
-
-        osmium::io::Reader fileReader(pbfFile, osmium::osm_entity_bits::way | osmium::osm_entity_bits::node);
-        Extractor extractor(segments);
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-        const auto temp_name = std::tmpnam(nullptr);
-#pragma clang diagnostic pop
-        int fd = open(temp_name, O_RDWR | O_CREAT, 0666);
-        if (fd == -1)
+        osmium::io::Reader wayReader(pbfFile, osmium::osm_entity_bits::way);
+        while (osmium::memory::Buffer buffer = wayReader.read())
         {
-            throw std::runtime_error(strerror(errno));
+            for (auto way = buffer.begin<osmium::Way>(); way != buffer.end<osmium::Way>(); ++way)
+            {
+                bool forward, reverse;
+                if (Extractor::classify(road_classes, *way, forward, reverse) == util::RoadClasses::NONE) continue;
+                for (const auto &node : way->nodes())
+                {
+                    if (node.ref() >= 0) node_ids.add(static_cast<std::uint64_t>(node.ref()));
+                }
+            }
+        }
+        wayReader.close();
+    }
+    node_ids.finish();
+    std::cerr << "Found " << node_ids.size() << " nodes on roads (" << node_ids.memory() << " bytes of node ids)" << std::endl;
+    util::NodeLocations node_locations(node_ids);
+
+    // Each thread extracts the ways of one buffer into vectors of its own,
+    // kept between rounds, whose chunks number their points and edges from
+    // zero.  They're appended in file order after each round, renumbered,
+    // so the result is the same however many threads there are.
+    struct extract_t {
+        std::vector<chunk_t> chunks;
+        std::vector<world_point_t> points;
+        std::vector<nodepair_t> edges;
+    };
+    std::vector<extract_t> extracts(num_threads);
+    std::vector<Extractor> extractors;
+    extractors.reserve(num_threads);
+    for (auto &extract : extracts) extractors.emplace_back(extract.chunks, extract.points, extract.edges, node_locations, road_classes);
+
+    std::vector<osmium::memory::Buffer> round;
+    const auto extractRound = [&]() {
+        util::parallelFor(round.size(), num_threads, [&](const std::size_t first, const std::size_t last) {
+            for (auto i = first; i < last; ++i)
+            {
+                for (auto way = round[i].begin<osmium::Way>(); way != round[i].end<osmium::Way>(); ++way) extractors[i].way(*way);
+            }
+        });
+        for (std::size_t i = 0; i < round.size(); ++i)
+        {
+            auto &extract = extracts[i];
+            const auto first_point = static_cast<std::uint32_t>(points.size());
+            const auto first_edge = static_cast<edge_id_t>(edges.size());
+            for (auto chunk : extract.chunks)
+            {
+                chunk.first_point += first_point;
+                chunk.first_edge += first_edge;
+                chunks.push_back(chunk);
+            }
+            points.insert(points.end(), extract.points.begin(), extract.points.end());
+            edges.insert(edges.end(), extract.edges.begin(), extract.edges.end());
+            extract.chunks.clear();
+            extract.points.clear();
+            extract.edges.clear();
         }
+        round.clear();
+    };
 
-        // unlinking before we close the file descriptor means the file
-        // will get automatically deleted when our program exits and
-        // releases the file descriptor
-        unlink(temp_name);
-        index_pos_type index_pos{fd};
-        index_neg_type index_neg;
-        location_handler_type location_handler(index_pos, index_neg);
-        location_handler.ignore_errors();
-        osmium::apply(fileReader, location_handler, extractor);
-
-        std::cerr << "Starting RTree construction" << std::endl;
-        rtree_ptr = std::make_shared<line_rtree_t>(segments);
-        std::cerr << "Loaded " << segments.size() << " into the rtree" << std::endl;
+    osmium::io::Reader fileReader(pbfFile, osmium::osm_entity_bits::way | osmium::osm_entity_bits::node);
+    // The reader decodes blocks on threads of its own.  Node locations are
+    // stored on this thread, in id order, and never while ways are being
+    // extracted from them.  Nodes come before ways in a sorted file, so a
+    // way's nodes are all there by the time it's extracted.
+    while (osmium::memory::Buffer buffer = fileReader.read())
+    {
+        if (buffer.begin<osmium::Node>() != buffer.end<osmium::Node>())
+        {
+            extractRound();
+            for (auto node = buffer.begin<osmium::Node>(); node != buffer.end<osmium::Node>(); ++node)
+            {
+                if (node->id() >= 0) node_locations.add(static_cast<std::uint64_t>(node->id()), node->location().x(), node->location().y());
+            }
+        }
+        if (buffer.begin<osmium::Way>() != buffer.end<osmium::Way>())
+        {
+            round.push_back(std::move(buffer));
+            if (round.size() == num_threads) extractRound();
+        }
     }
-    catch (const osmium::xml_error &e)
+    extractRound();
+    fileReader.close();
+    node_locations.finish();
+    std::cerr << "Stored the locations of road nodes in " << node_locations.memory() << " bytes" << std::endl;
+
+    std::cerr << "Starting index construction" << std::endl;
+    roads.index.build(chunks, chunk_minzoom(), chunk_indexable(), num_threads);
+    std::vector<std::uint32_t> chunks_by_edge(chunks.size());
+    std::iota(chunks_by_edge.begin(), chunks_by_edge.end(), 0);
+    util::parallelStableSort(chunks_by_edge.begin(), chunks_by_edge.end(), [&chunks](const std::uint32_t a, const std::uint32_t b) {
+        return chunks[a].first_edge < chunks[b].first_edge;
+    }, num_threads);
+    roads.chunks = util::Array<chunk_t>(std::move(chunks));
+    roads.points = util::Array<world_point_t>(std::move(points));
+    roads.chunks_by_edge = util::Array<std::uint32_t>(std::move(chunks_by_edge));
+
+    // Speed rows name edges by their nodes, which only this lookup needs
+    // from here on
+    edge_lookup = util::EdgeLookup(edges, num_threads);
+}
+
+// Marks the tiles the given edges are drawn on
+void markEdgeTiles(const RoadIndex &roads, const std::vector<edge_id_t> &edges, util::tile::DirtyTiles &tiles)
+{
+    for (const auto edge : edges)
     {
-        std::cerr << "Error: xml parse error in " << argv[1] << ": " << e.what() << std::endl;
-        return EXIT_FAILURE;
+        // The last chunk starting at or before the edge
+        const auto found = std::upper_bound(roads.chunks_by_edge.begin(), roads.chunks_by_edge.end(), edge,
+                                            [&roads](const edge_id_t edge, const std::uint32_t chunk) { return edge < roads.chunks[chunk].first_edge; });
+        if (found == roads.chunks_by_edge.begin()) continue;
+        const auto &chunk = roads.chunks[*(found - 1)];
+        const auto segment = edge - chunk.first_edge;
+        if (segment + 1 >= chunk.num_points) continue;
+        tiles.addSegment(roads.points[chunk.first_point + segment], roads.points[chunk.first_point + segment + 1], chunk.minzoom);
     }
-    catch (const osmium::io_error &e)
+}
+
+// Encodes one tile's merged lines into pbf_buffer, with mergers holding one
+// merger per speed bin
+void encodeTile(const LineMerger *mergers,
+                const util::speeds::SpeedBins &bins,
+                const int z,
+                RenderScratch &scratch,
+                std::string &pbf_buffer)
+{
+    pbf_buffer.clear();
     {
-        std::cerr << "Error: error reading file " << argv[1] << ": " << e.what() << std::endl;
-        return EXIT_FAILURE;
+
+        protozero::pbf_writer tile_writer{pbf_buffer};
+        {
+            // Add a layer object to the PBF stream.  3=='layer' from the vector tile spec (2.1)
+            protozero::pbf_writer line_layer_writer(tile_writer, util::vector_tile::LAYER_TAG);
+            line_layer_writer.add_uint32(util::vector_tile::VERSION_TAG, 2); // version
+            // Field 1 is the "layer name" field, it's a string
+            line_layer_writer.add_string(util::vector_tile::NAME_TAG, "geom"); // name
+            // Field 5 is the tile extent.  It's a uint32 and should be set to 4096
+            // for normal vector tiles.
+            line_layer_writer.add_uint32(util::vector_tile::EXTENT_TAG,
+                                         util::vector_tile::EXTENT); // extent
+            // Every feature has the one "congestion" attribute, key 0.  Its
+            // values are the names of the bins used on this tile, numbered
+            // in the order they're first used.
+            auto &bin_values = scratch.bin_values;
+            auto &used_bins = scratch.used_bins;
+            bin_values.assign(bins.size(), NO_VALUE);
+            used_bins.clear();
+
+            std::int32_t id = 1;
+            const double tolerance = util::tile::simplifyTolerance(z);
+            for (std::size_t bin = 0; bin < bins.size(); ++bin) {
+                mergers[bin].forEachLine(scratch.tile_line, [&](util::tile::tile_linestring_t &line) {
+                    util::tile::removeRepeatedPoints(line);
+                    util::tile::simplifyLine(line, tolerance, scratch.simplify_stack, scratch.simplify_keep);
+                    // Nobody will see a line shorter than a pixel
+                    if (util::tile::lineLength(line) < util::tile::PIXEL) return;
+
+                    if (bin_values[bin] == NO_VALUE) {
+                        bin_values[bin] = static_cast<std::uint32_t>(used_bins.size());
+                        used_bins.push_back(static_cast<util::speeds::SpeedBins::bin_t>(bin));
+                    }
+
+                    std::int32_t start_x = 0;
+                    std::int32_t start_y = 0;
+                    protozero::pbf_writer feature_writer(line_layer_writer, util::vector_tile::FEATURE_TAG);
+                    feature_writer.add_enum(util::vector_tile::GEOMETRY_TAG, util::vector_tile::GEOMETRY_TYPE_LINE);
+                    feature_writer.add_uint64(util::vector_tile::ID_TAG, id++);
+                    {
+                        protozero::packed_field_uint32 attributes(feature_writer, util::vector_tile::FEATURE_ATTRIBUTES_TAG);
+                        attributes.add_element(0);
+                        attributes.add_element(bin_values[bin]);
+                    }
+                    {
+                        protozero::packed_field_uint32 geometry(feature_writer, util::vector_tile::FEATURE_GEOMETRIES_TAG);
+                        util::tile::encodeLinestring(line, geometry, start_x, start_y);
+                    }
+                });
+            }
+
+            // The key and value tables can follow the features they're used by
+            if (!used_bins.empty()) {
+                line_layer_writer.add_string(util::vector_tile::KEY_TAG, "congestion");
+                for (const auto bin : used_bins) {
+                    protozero::pbf_writer value_writer(line_layer_writer, util::vector_tile::VARIANT_TAG);
+                    value_writer.add_string(util::vector_tile::VARIANT_TYPE_STRING, bins.name(bin));
+                }
+            }
+        }
     }
+}
 
+/**
+ * Renders the size x size block of tiles at zoom z whose top left tile is
+ * x/y into scratch.pbf_buffers, row by row, with each line's speed bin
+ * worked out from the free flow and current speeds.  Neighbouring tiles
+ * share most of the chunks near them, so the block is rendered from one
+ * index query, and each chunk is projected once and then clipped onto
+ * each tile it's on.  Every tile comes out exactly as it would on its own.
+ **/
+void renderMetatile(const RoadIndex &roads,
+                    const util::speeds::SpeedBins &bins,
+                    const util::speeds::SpeedTable &freeflow,
+                    const util::speeds::SpeedTable &current,
+                    const int x,
+                    const int y,
+                    const int z,
+                    const int size,
+                    RenderScratch &scratch)
+{
+    const auto first_box = util::tile::searchBox(x, y, z);
+    const auto last_box = util::tile::searchBox(x + size - 1, y + size - 1, z);
+    const world_box_t search_box(first_box.min_corner(), last_box.max_corner());
+    auto &ranges = scratch.ranges;
+    ranges.clear();
+    roads.index.query(search_box, z, ranges, scratch.stack);
+
+    const util::tile::TileTransform transform(x, y, z);
+    // The tile of the block a world coordinate is on, counting from x or y
+    const auto tile_shift = util::web_mercator::WORLD_BITS - static_cast<unsigned>(z);
+    const auto tileOf = [tile_shift](const std::uint32_t world, const int first) { return static_cast<int>(std::uint64_t{world} >> tile_shift) - first; };
+
+    /**
+     * Now, iterate over all the chunks, clip them into runs of
+     * segments in the same speed bin on each tile, and join those into
+     * longer lines in that bin, if possible.  Runs already hold whole
+     * stretches of a way, so this mostly stitches across way boundaries.
+     * This means fewer features on the tile and a smaller tile size to
+     * encode.  We also take this opportunity to eliminate segments of 0
+     * length (where they form part of a longer line).
+     **/
+
+    const auto num_tiles = static_cast<std::size_t>(size * size);
+    auto &mergers = scratch.mergers;
+    if (mergers.size() < num_tiles * bins.size()) mergers.resize(num_tiles * bins.size());
+    for (std::size_t i = 0; i < num_tiles * bins.size(); ++i) mergers[i].clear();
+
+    const chunk_indexable indexable;
+    for (const auto &range : ranges) {
+        for (auto i = range.first; i < range.second; ++i) {
+            const auto &chunk = roads.chunks[i];
+
+            // The index only narrows things down to runs of chunks, check
+            // each one is actually on the block, and find the tiles its box
+            // is on, which are the tiles it would be drawn on by itself
+            const auto box = indexable(chunk);
+            if (boost::geometry::disjoint(box, search_box)) continue;
+            const auto first_column = std::max(0, tileOf(chunk.min_x, x));
+            const auto last_column = std::min(size - 1, tileOf(chunk.max_x, x));
+            const auto first_row = std::max(0, tileOf(chunk.min_y, y));
+            const auto last_row = std::min(size - 1, tileOf(chunk.max_y, y));
+
+            util::tile::projectPoints(&roads.points[chunk.first_point], chunk.num_points, transform, scratch.projected);
+            const auto bin = [&](const std::size_t segment) { return bins.edgeBin(freeflow, current, chunk.first_edge + segment); };
+            for (auto row = first_row; row <= last_row; ++row) {
+                for (auto column = first_column; column <= last_column; ++column) {
+                    LineMerger *tile_mergers = &mergers[static_cast<std::size_t>(row * size + column) * bins.size()];
+                    util::tile::clipChunk(scratch.projected.data(), chunk.num_points, column, row, scratch.run, bin,
+                                          [tile_mergers](const util::tile::tile_linestring_t &run, const util::speeds::SpeedBins::bin_t bin) { tile_mergers[bin].add(run); });
+                }
+            }
+        }
+    }
 
-    HttpServer server(8080,1);
+    auto &pbf_buffers = scratch.pbf_buffers;
+    if (pbf_buffers.size() < num_tiles) pbf_buffers.resize(num_tiles);
+    for (std::size_t tile = 0; tile < num_tiles; ++tile) encodeTile(&mergers[tile * bins.size()], bins, z, scratch, pbf_buffers[tile]);
+}
 
-    server.resource["^/tile/([0-9]+)/([0-9]+)/([0-9]+).mvt"]["GET"] = [&rtree_ptr](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
+// Renders the size x size block of tiles with x/y at its top left from one
+// generation of the current speeds, and caches every tile of it.  Returns
+// the tiles row by row, to send.
+std::vector<TileCache::tile_t> renderBlock(const RoadIndex &roads,
+                                           const util::speeds::SpeedBins &bins,
+                                           const util::speeds::SpeedTable &freeflow,
+                                           util::speeds::SpeedStore &current_speeds,
+                                           TileCache &tile_cache,
+                                           const int x,
+                                           const int y,
+                                           const int z,
+                                           const int size,
+                                           RenderScratch &scratch)
+{
+    // Holding the snapshot pins one generation of speeds for the whole
+    // render, however many updates land meanwhile
+    const auto speeds = current_speeds.snapshot();
+    renderMetatile(roads, bins, freeflow, speeds.table(), x, y, z, size, scratch);
+
+    // Each encoded tile is handed over to the cache and responses without
+    // copying it, and written straight to the socket after the static
+    // header.  Its buffer is reserved back at the tile's size, so the next
+    // render writes into one allocation rather than growing from empty.
+    std::vector<TileCache::tile_t> tiles;
+    tiles.reserve(static_cast<std::size_t>(size * size));
+    for (int row = 0; row < size; ++row) {
+        for (int column = 0; column < size; ++column) {
+            auto &pbf_buffer = scratch.pbf_buffers[tiles.size()];
+            tiles.push_back(std::make_shared<const std::string>(std::move(pbf_buffer)));
+            pbf_buffer.reserve(tiles.back()->size());
+            tile_cache.insert(x + column, y + row, z, speeds.generation(), tiles.back());
+        }
+    }
+    return tiles;
+}
 
-        std::thread work_thread([&rtree_ptr, request, response] {
+// The tiles of a /metatile block, row by row, as a bundle message
+std::shared_ptr<const std::string> encodeBundle(const std::vector<TileCache::tile_t> &tiles, const int x, const int y, const int z, const int size)
+{
+    std::size_t bytes = 0;
+    for (const auto &tile : tiles) bytes += tile->size() + 32;
+    auto bundle = std::make_shared<std::string>();
+    bundle->reserve(bytes);
+    protozero::pbf_writer bundle_writer{*bundle};
+    for (std::size_t i = 0; i < tiles.size(); ++i) {
+        protozero::pbf_writer tile_writer(bundle_writer, BUNDLE_TILE_TAG);
+        tile_writer.add_uint32(BUNDLE_X_TAG, static_cast<std::uint32_t>(x + static_cast<int>(i) % size));
+        tile_writer.add_uint32(BUNDLE_Y_TAG, static_cast<std::uint32_t>(y + static_cast<int>(i) / size));
+        tile_writer.add_uint32(BUNDLE_Z_TAG, static_cast<std::uint32_t>(z));
+        tile_writer.add_bytes(BUNDLE_DATA_TAG, tiles[i]->data(), tiles[i]->size());
+    }
+    return bundle;
+}
 
-        int x = std::stoi(request->path_match[1]);
-        int y = std::stoi(request->path_match[2]);
-        int z = std::stoi(request->path_match[3]);
+int main(int argc, char* argv[])
+{
+    // bin/server build <map.pbf> <map.snapshot> just writes the snapshot
+    const bool build = argc > 1 && std::strcmp(argv[1], "build") == 0;
+    if (argc < 4 || argc > 5)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *map_path = build ? argv[2] : argv[1];
 
-        // TODO: validate the x/y/z
+    util::config::Config config;
+    if (argc == 5)
+    {
+        try
+        {
+            config = util::config::Config::load(argv[4]);
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Loaded " << config.road_classes.size() << " road classes and " << config.speed_bins.size() - 1
+                  << " speed bins from " << argv[4] << std::endl;
+    }
 
+    // Ingest, index construction and speed loading all use every core
+    const std::size_t load_threads = std::max(1u, std::thread::hardware_concurrency());
 
-    	double min_lon, min_lat, max_lon, max_lat;
+    auto roads_ptr = std::make_shared<RoadIndex>();
+    util::EdgeLookup edge_lookup;
+    // Everything loaded from a snapshot points into its mapping, so it's
+    // kept for as long as the server runs
+    std::unique_ptr<const util::snapshot::Reader> snapshot;
 
-        util::web_mercator::xyzToWGS84( x, y, z, min_lon, min_lat, max_lon, max_lat);
+    try
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!build && util::snapshot::Reader::isSnapshot(map_path))
+        {
+            std::cerr << "Mapping " << map_path << std::endl;
+            snapshot.reset(new util::snapshot::Reader(map_path));
+            roads_ptr->load(*snapshot);
+            edge_lookup.load(*snapshot, "edges");
+        }
+        else
+        {
+            std::cerr << "Parsing " << map_path << std::endl;
+            buildRoads(map_path, config.road_classes, *roads_ptr, edge_lookup, load_threads);
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Loaded " << edge_lookup.size() << " segments as " << roads_ptr->chunks.size() << " chunks into the index in "
+                  << elapsed.count() << "s (" << roads_ptr->points.size() << " points, " << sizeof(chunk_t) << " bytes per chunk, "
+                  << roads_ptr->index.numBands() << " zoom bands, "
+                  << roads_ptr->index.memory() << " bytes of index nodes, "
+                  << edge_lookup.memory() << " bytes of edge lookup)" << std::endl;
+
+        if (build)
+        {
+            util::snapshot::Writer writer(argv[3]);
+            roads_ptr->save(writer);
+            edge_lookup.save(writer, "edges");
+            writer.commit();
+            std::cerr << "Wrote " << writer.size() << " bytes to " << argv[3] << std::endl;
+            return EXIT_SUCCESS;
+        }
+    }
+    catch (const osmium::xml_error &e)
+    {
+        std::cerr << "Error: xml parse error in " << map_path << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (const osmium::io_error &e)
+    {
+        std::cerr << "Error: error reading file " << map_path << ": " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    const auto num_edges = edge_lookup.size();
 
-        wgs84_box_t search_box({min_lon, min_lat, 0}, {max_lon, max_lat, z});
-        std::vector<rtree_value_t> results;
-        rtree_ptr->query(boost::geometry::index::intersects(search_box), std::back_inserter(results));
+    util::speeds::SpeedTable freeflow(num_edges);
+    util::speeds::SpeedTable current(num_edges);
+    try
+    {
+        for (const auto &file : {std::make_pair(argv[2], &freeflow), std::make_pair(argv[3], &current)})
+        {
+            std::cerr << "Loading speeds from " << file.first << std::endl;
+            const auto start = std::chrono::steady_clock::now();
+            const auto stats = util::speeds::loadSpeedFile(file.first, edge_lookup, *file.second, load_threads);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cerr << "Loaded " << stats.rows << " rows in " << elapsed.count() << "s (" << stats.updates
+                      << " edge directions set, " << stats.unmatched << " rows matching no edge, "
+                      << stats.malformed << " malformed lines)" << std::endl;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
 
-        double min_merc_x, min_merc_y, max_merc_x, max_merc_y;
-        util::web_mercator::xyzToMercator(x, y, z, min_merc_x, min_merc_y, max_merc_x, max_merc_y);
-        util::tile::mercator_box_t tile_bbox({min_merc_x, min_merc_y}, {max_merc_x, max_merc_y});
+    // Current speeds change while the server runs, see the /speeds handler
+    util::speeds::SpeedStore current_speeds(std::move(current));
+    const auto &speed_bins = config.speed_bins;
 
-        /* GEOJSON
-        std::stringstream s;
-        s << "{\"type\":\"FeatureCollection\",\"features\":[\n";
+    HttpServer server(8080,1);
+    // One event loop per core, each with its own SO_REUSEPORT acceptor, so
+    // request parsing and socket writes scale with the number of cores.
+    server.config.num_loops = std::max(1u, std::thread::hardware_concurrency());
+
+    // The render pool does the heavy lifting so the HTTP thread only parses
+    // requests and writes responses.  If more than render_queue_limit tiles
+    // are already waiting, new requests get a 503 straight away rather than
+    // piling up behind a backlog they'd time out in anyway.
+    const std::size_t render_threads = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t render_queue_limit = render_threads * 16;
+    render_pool_t render_pool(render_threads, render_queue_limit);
+    std::cerr << "Rendering with " << render_pool.size() << " threads, queue limit " << render_queue_limit << std::endl;
+
+    // Encoded tiles are kept until they're evicted or an update changes
+    // what's drawn on them.  Every tile is stamped with the generation of
+    // the speeds it was rendered from, and each update drops just the tiles
+    // where a segment moved to another speed bin, which are also logged for
+    // caches further out to ask after.
+    const std::size_t tile_cache_bytes = 256 * 1024 * 1024;
+    TileCache tile_cache(tile_cache_bytes);
+    util::tile::DirtyLog dirty_log;
+
+    // Speed updates are applied one at a time, in the order they arrive, on
+    // a thread of their own.  Each one waits for the renders still using
+    // the speeds it replaces, which mustn't hold up an event loop.
+    const std::size_t update_queue_limit = 16;
+    update_pool_t update_pool(1, update_queue_limit);
+
+    // Tiles are the hot path, so they're matched by hand while the request
+    // is parsed rather than going through the regex routes.  The matcher also
+    // validates x/y/z, anything out of range falls through to the 404 handler.
+    const auto match_tile = [](const char *begin, const char *end, HttpServer::Request &request) {
+        return util::tile::parseTilePath(begin, end, request.path_values[0], request.path_values[1], request.path_values[2]);
+    };
 
-        bool first = true;
-        char lon1[16];
-        char lat1[16];
-        char lon2[16];
-        char lat2[16];
-        for (const auto &result : results) {
-            if (first) { first = false; } else { s << ",\n"; }
+    // A tile that isn't cached is rendered along with the rest of the
+    // aligned metatile it's in, which costs little more than the tile alone,
+    // and those are cached for the requests a client panning will send next
+    const int metatile_size = config.metatile_size;
+    pending_blocks_t pending_blocks;
 
+    server.fast_resource["GET"].emplace_back(match_tile, [&roads_ptr, &render_pool, &tile_cache, &pending_blocks, &current_speeds, &freeflow, &speed_bins, metatile_size](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
 
-            std::snprintf(lon1, sizeof(lon1), "%.7f", result.first.first.get<0>());
-            std::snprintf(lat1, sizeof(lat1), "%.7f", result.first.first.get<1>());
-            std::snprintf(lon2, sizeof(lon2), "%.7f", result.first.second.get<0>());
-            std::snprintf(lat2, sizeof(lat2), "%.7f", result.first.second.get<1>());
+        const int x = request->path_values[0];
+        const int y = request->path_values[1];
+        const int z = request->path_values[2];
 
-            s << "{\"type\":\"Feature\",\"properties\":[],\"geometry\":{\"type\":\"LineString\",\"coordinates\":[[" << lon1 << "," << lat1 << "],[" << lon2 << "," << lat2 << "]]}}";
+        // Cached tiles are sent straight from the event loop
+        if (const auto tile = tile_cache.find(x, y, z))
+        {
+            response->set_content(TILE_RESPONSE_HEADER, tile);
+            return;
         }
-        s << "]}";
 
-        *response << "HTTP/1.1 200 OK\r\nContent-Length: " << s.str().length() << "\r\n\r\n" << s.str();
-        */
+        // Only the first miss in a block renders it, the rest wait for that
+        const int size = std::min(metatile_size, 1 << z);
+        const pending_blocks_t::key_t block{x - x % size, y - y % size, z, current_speeds.generation()};
+        if (!pending_blocks.join(block, TileWaiter{response, x, y})) return;
 
+        const bool queued = render_pool.submit([&roads_ptr, &tile_cache, &pending_blocks, &current_speeds, &freeflow, &speed_bins, block, size](RenderScratch &scratch) {
+            const auto tiles = renderBlock(*roads_ptr, speed_bins, freeflow, current_speeds, tile_cache, block.x, block.y, block.z, size, scratch);
 
-        /**
-         * Now, iterate over all the segments, and join them into longer
-         * lines, if possible.  This means fewer features on the tile
-         * and a smaller tile size to encode.
-         * We also take this opportunity to eliminate segments of 0
-         * length (where they form part of a longer line).
-         **/
+            for (const auto &waiter : pending_blocks.finish(block)) {
+                waiter.response->set_content(TILE_RESPONSE_HEADER, tiles[static_cast<std::size_t>((waiter.y - block.y) * size + waiter.x - block.x)]);
+            }
+        });
 
-        tile_line_vector lines;
-        coordinate_line_map starts;
-        coordinate_line_map ends;
+        if (!queued)
+        {
+            std::string content="Too many pending tile requests";
+            for (const auto &waiter : pending_blocks.finish(block)) {
+                *waiter.response << "HTTP/1.1 503 Service Unavailable\r\nContent-Length: " << content.length() << "\r\n";
+                *waiter.response << "Retry-After: 1\r\n\r\n" << content;
+            }
+        }
+    });
 
-        for (const auto &segment : results) {
-            std::int32_t start_x = 0;
-            std::int32_t start_y = 0;
-            const auto tile_line = util::tile::segmentToTileLine(segment.first, tile_bbox);
+    // Sends the size x size block of tiles at zoom z with x/y at its top
+    // left as one bundle, from the cache if every tile is there, and
+    // otherwise rendered together and cached
+    server.resource["^/metatile/([2-8])/([0-9]{1,7})/([0-9]{1,7})/([0-9]{1,2})\\.bundle$"]["GET"]=[&roads_ptr, &render_pool, &tile_cache, &current_speeds, &freeflow, &speed_bins](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
+        const int size = std::atoi(request->path_match[1].str().c_str());
+        const int x = std::atoi(request->path_match[2].str().c_str());
+        const int y = std::atoi(request->path_match[3].str().c_str());
+        const int z = std::atoi(request->path_match[4].str().c_str());
+        if (z > util::tile::MAX_ZOOM || x + size > (1 << z) || y + size > (1 << z)) {
+            std::string content="Not found";
+            *response << "HTTP/1.1 404 Not Found\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
+            return;
+        }
 
-            if (tile_line.size() != 2) continue;
+        std::vector<TileCache::tile_t> tiles;
+        for (int i = 0; i < size * size; ++i) {
+            auto tile = tile_cache.find(x + i % size, y + i / size, z);
+            if (!tile) break;
+            tiles.push_back(std::move(tile));
+        }
+        if (tiles.size() == static_cast<std::size_t>(size * size)) {
+            response->set_content(BUNDLE_RESPONSE_HEADER, encodeBundle(tiles, x, y, z, size));
+            return;
+        }
 
-            merge(tile_line, lines, starts, ends);
+        const bool queued = render_pool.submit([&roads_ptr, &tile_cache, &current_speeds, &freeflow, &speed_bins, response, x, y, z, size](RenderScratch &scratch) {
+            const auto tiles = renderBlock(*roads_ptr, speed_bins, freeflow, current_speeds, tile_cache, x, y, z, size, scratch);
+            response->set_content(BUNDLE_RESPONSE_HEADER, encodeBundle(tiles, x, y, z, size));
+        });
 
+        if (!queued)
+        {
+            std::string content="Too many pending tile requests";
+            *response << "HTTP/1.1 503 Service Unavailable\r\nContent-Length: " << content.length() << "\r\n";
+            *response << "Retry-After: 1\r\n\r\n" << content;
         }
+    };
 
-        std::string pbf_buffer;
-        {
+    server.resource["^/cache/stats$"]["GET"]=[&tile_cache](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request>) {
+        const auto stats = tile_cache.stats();
+        const auto lookups = stats.hits + stats.misses;
+        char content[512];
+        const int length = std::snprintf(content, sizeof(content),
+            "{\"entries\":%zu,\"bytes\":%zu,\"capacity\":%zu,\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+            ",\"evictions\":%" PRIu64 ",\"invalidations\":%" PRIu64 ",\"hit_rate\":%.4f}",
+            stats.entries, stats.bytes, stats.capacity, stats.hits, stats.misses, stats.evictions,
+            stats.invalidations, lookups == 0 ? 0. : static_cast<double>(stats.hits) / lookups);
+        *response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << length << "\r\n\r\n" << content;
+    };
 
-            protozero::pbf_writer tile_writer{pbf_buffer};
-            {
-                // Add a layer object to the PBF stream.  3=='layer' from the vector tile spec (2.1)
-                protozero::pbf_writer line_layer_writer(tile_writer, util::vector_tile::LAYER_TAG);
-                line_layer_writer.add_uint32(util::vector_tile::VERSION_TAG, 2); // version
-                // Field 1 is the "layer name" field, it's a string
-                line_layer_writer.add_string(util::vector_tile::NAME_TAG, "geom"); // name
-                // Field 5 is the tile extent.  It's a uint32 and should be set to 4096
-                // for normal vector tiles.
-                line_layer_writer.add_uint32(util::vector_tile::EXTENT_TAG,
-                                             util::vector_tile::EXTENT); // extent
-                std::int32_t id = 1;
-                for (const auto & startlist : starts) {
-                    for (const auto &start : startlist.second) {
-                        const auto &line = lines[start];
-                        std::int32_t start_x = 0;
-                        std::int32_t start_y = 0;
-                        protozero::pbf_writer feature_writer(line_layer_writer, util::vector_tile::FEATURE_TAG);
-                        feature_writer.add_enum(util::vector_tile::GEOMETRY_TAG, util::vector_tile::GEOMETRY_TYPE_LINE);
-                        feature_writer.add_uint64(util::vector_tile::ID_TAG, id++);
-                        {
-                            protozero::packed_field_uint32 geometry(feature_writer, util::vector_tile::FEATURE_GEOMETRIES_TAG);
-                            util::tile::encodeLinestring(line, geometry, start_x, start_y);
-                        }
-                    }
-                }
-                /*
-                std::int32_t id = 1;
-                for (const auto &segment : results) {
-                    std::int32_t start_x = 0;
-                    std::int32_t start_y = 0;
-                    const auto tile_line = util::tile::segmentToTileLine(segment.first, tile_bbox);
-                    // Only encode if there's actually geometry, the VT 2+ spec requires this.
-                    if (tile_line.size() > 1) {
-                        protozero::pbf_writer feature_writer(line_layer_writer, util::vector_tile::FEATURE_TAG);
-                        feature_writer.add_enum(util::vector_tile::GEOMETRY_TAG, util::vector_tile::GEOMETRY_TYPE_LINE);
-                        // TODO: should ID be globally unique?
-                        feature_writer.add_uint64(util::vector_tile::ID_TAG, x*y+id++);
-                        {
-                            protozero::packed_field_uint32 geometry(feature_writer, util::vector_tile::FEATURE_GEOMETRIES_TAG);
-                            util::tile::encodeLinestring(tile_line, geometry, start_x, start_y);
-                        }
-                    }
+    // Takes a nodeA,nodeB,speed CSV of new current speeds and publishes them
+    // all at once as the next generation.  Renders already running finish
+    // with the speeds they started with.  Tiles where a segment changed
+    // speed bin are dropped from the cache and logged for /dirty.  All of
+    // that runs on the update thread, which replies once it's done, so the
+    // event loop carries on with other connections meanwhile.
+    server.resource["^/speeds$"]["POST"]=[&roads_ptr, &edge_lookup, &current_speeds, &freeflow, &speed_bins, &tile_cache, &dirty_log, &update_pool, load_threads](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
+        auto body = std::make_shared<const std::string>(request->content.string());
+        const bool queued = update_pool.submit([&roads_ptr, &edge_lookup, &current_speeds, &freeflow, &speed_bins, &tile_cache, &dirty_log, load_threads, response, body](UpdateScratch &scratch) {
+            auto &updates = scratch.updates;
+            updates.clear();
+            const auto stats = util::speeds::parseSpeeds(body->data(), body->size(), edge_lookup, load_threads, [&updates](const std::vector<util::speeds::update_t> &block) {
+                updates.insert(updates.end(), block.begin(), block.end());
+            });
+
+            // Only a change of bin changes a tile
+            auto &changed = scratch.changed;
+            changed.clear();
+            const auto generation = current_speeds.apply(std::move(updates), [&](const util::speeds::SpeedTable &before, const util::speeds::SpeedTable &after, const std::vector<util::speeds::update_t> &applied) {
+                for (const auto &update : applied) {
+                    if (speed_bins.edgeBin(freeflow, before, update.edge) != speed_bins.edgeBin(freeflow, after, update.edge)) changed.push_back(update.edge);
                 }
-                */
-            }
+            });
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+            auto dirty = std::make_shared<util::tile::DirtyTiles>();
+            markEdgeTiles(*roads_ptr, changed, *dirty);
+            dirty->finish();
+
+            // A render from the old speeds could still put a changed tile back
+            current_speeds.waitForSnapshotsBefore(generation);
+            std::size_t num_dirty = 0;
+            dirty->forEach([&tile_cache, &num_dirty](const int x, const int y, const int z) {
+                tile_cache.erase(x, y, z);
+                ++num_dirty;
+            });
+            dirty_log.add(generation, std::move(dirty));
+
+            char content[256];
+            const int length = std::snprintf(content, sizeof(content),
+                "{\"generation\":%" PRIu64 ",\"rows\":%" PRIu64 ",\"updates\":%" PRIu64 ",\"unmatched\":%" PRIu64 ",\"malformed\":%" PRIu64
+                ",\"changed_edges\":%zu,\"dirty_tiles\":%zu}",
+                generation, stats.rows, stats.updates, stats.unmatched, stats.malformed, changed.size(), num_dirty);
+            *response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << length << "\r\n\r\n" << content;
+        });
+
+        if (!queued)
+        {
+            std::string content="Too many pending speed updates";
+            *response << "HTTP/1.1 503 Service Unavailable\r\nContent-Length: " << content.length() << "\r\n";
+            *response << "Retry-After: 1\r\n\r\n" << content;
         }
+    };
 
-        //std::cout << "GET /" << x << "/" << y << "/" << z << ".mvt - " << pbf_buffer.size() << " bytes\n";
+    // Lists the tiles at zoom z changed by updates after generation since,
+    // as {"generation":latest,"z":z,"tiles":[[x,y],...]}.  If some of those
+    // updates are too old to remember, the answer is 410 Gone, and the
+    // caller should assume everything changed.
+    server.resource["^/dirty/([0-9]{1,19})/([0-9]{1,2})$"]["GET"]=[&dirty_log](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
+        const auto since = std::strtoull(request->path_match[1].str().c_str(), nullptr, 10);
+        const int z = std::atoi(request->path_match[2].str().c_str());
+        if (z > util::tile::MAX_ZOOM) {
+            std::string content="Not found";
+            *response << "HTTP/1.1 404 Not Found\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
+            return;
+        }
 
-        *response << "HTTP/1.1 200 OK\r\nContent-Length: " << pbf_buffer.size() << "\r\n";
-        *response << "Content-Type: application/vnd.mapbox-vector-tile\r\n";
-        *response << "Access-Control-Allow-Origin: *\r\n\r\n";
-        *response << pbf_buffer;
+        std::vector<std::uint64_t> tiles, merged;
+        std::uint64_t latest;
+        const bool known = dirty_log.since(since, latest, [&](const util::tile::DirtyTiles &update) {
+            const auto update_tiles = update.tiles(z);
+            merged.clear();
+            std::set_union(tiles.begin(), tiles.end(), update_tiles.begin(), update_tiles.end(), std::back_inserter(merged));
+            tiles.swap(merged);
         });
-        work_thread.detach();
+        if (!known) {
+            std::string content="Updates since that generation are no longer known";
+            *response << "HTTP/1.1 410 Gone\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
+            return;
+        }
+
+        std::string content = "{\"generation\":" + std::to_string(latest) + ",\"z\":" + std::to_string(z) + ",\"tiles\":[";
+        bool first = true;
+        for (const auto key : tiles) {
+            if (!first) content += ',';
+            first = false;
+            content += '[' + std::to_string(key >> 32) + ',' + std::to_string(key & 0xffffffff) + ']';
+        }
+        content += "]}";
+        *response << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
     };
 
-    server.default_resource["GET"]=[](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) {
+    server.default_resource["GET"]=[](std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request>) {
         std::string content="Not found";
         *response << "HTTP/1.1 404 Not Found\r\nContent-Length: " << content.length() << "\r\n\r\n" << content;
     };
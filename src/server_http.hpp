@@ -7,11 +7,19 @@
 #include <boost/functional/hash.hpp>
 
 #include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <memory>
 #include <thread>
 #include <functional>
 #include <iostream>
 #include <sstream>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace SimpleWeb {
     template <class socket_type>
     class ServerBase {
@@ -24,12 +32,53 @@ namespace SimpleWeb {
             boost::asio::streambuf streambuf;
 
             std::shared_ptr<socket_type> socket;
+            boost::asio::io_service &io_service;
+
+            Response(std::shared_ptr<socket_type> socket, boost::asio::io_service &io_service): std::ostream(&streambuf), socket(socket), io_service(io_service),
+                    content_header(nullptr), content_header_size(0), content_length_size(0) {}
 
-            Response(std::shared_ptr<socket_type> socket): std::ostream(&streambuf), socket(socket) {}
+            //Set by set_content, sent after anything written to the stream
+            std::shared_ptr<const std::string> content;
+            const char* content_header;
+            size_t content_header_size;
+            char content_length[48];
+            size_t content_length_size;
 
         public:
             size_t size() {
-                return streambuf.size();
+                return streambuf.size()+content_header_size+content_length_size+(content ? content->size() : 0);
+            }
+
+            ///Sends content after header in a single gather write, without copying either of them.
+            ///header holds the status line and any fixed header fields and must stay valid until the
+            ///response is sent (a string literal is ideal); the Content-Length field and the blank
+            ///line ending the header are added here.  content is kept alive until it has been sent.
+            void set_content(const char* header, size_t header_size, std::shared_ptr<const std::string> content) {
+                content_header=header;
+                content_header_size=header_size;
+                this->content=std::move(content);
+
+                static const char field[]="Content-Length: ";
+                char digits[24];
+                size_t num_digits=0;
+                auto length=this->content ? this->content->size() : 0;
+                do {
+                    digits[num_digits++]=static_cast<char>('0'+length%10);
+                    length/=10;
+                } while(length>0);
+                std::copy(field, field+sizeof(field)-1, content_length);
+                content_length_size=sizeof(field)-1;
+                while(num_digits>0)
+                    content_length[content_length_size++]=digits[--num_digits];
+                content_length[content_length_size++]='\r';
+                content_length[content_length_size++]='\n';
+                content_length[content_length_size++]='\r';
+                content_length[content_length_size++]='\n';
+            }
+
+            template<size_t N>
+            void set_content(const char (&header)[N], std::shared_ptr<const std::string> content) {
+                set_content(header, N-1, std::move(content));
             }
         };
 
@@ -64,7 +113,7 @@ namespace SimpleWeb {
               size_t operator()(const std::string &key) const {
                 std::size_t seed=0;
                 for(auto &c: key)
-                  boost::hash_combine(seed, std::tolower(c));
+                  boost::hash_combine(seed, std::tolower(static_cast<unsigned char>(c)));
                 return seed;
               }
             };
@@ -77,14 +126,23 @@ namespace SimpleWeb {
 
             boost::smatch path_match;
 
+            ///Filled in by the matcher of a fast_resource route
+            std::array<int, 4> path_values;
+
             std::string remote_endpoint_address;
             unsigned short remote_endpoint_port;
 
         private:
-            Request(): content(streambuf) {}
+            Request(): content(streambuf), fast_resource_function(nullptr), content_length(0), close_connection(false), bad_request(false) {}
 
             boost::asio::streambuf streambuf;
 
+            std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> *fast_resource_function;
+            unsigned long long content_length;
+            bool close_connection;
+            ///Set by parse_request when the header is well formed enough to answer 400
+            bool bad_request;
+
             void read_remote_endpoint_data(socket_type& socket) {
                 try {
                     remote_endpoint_address=socket.lowest_layer().remote_endpoint().address().to_string();
@@ -97,7 +155,7 @@ namespace SimpleWeb {
         class Config {
             friend class ServerBase<socket_type>;
 
-            Config(unsigned short port, size_t num_threads): num_threads(num_threads), port(port), reuse_address(true) {}
+            Config(unsigned short port, size_t num_threads): num_threads(num_threads), port(port), reuse_address(true), num_loops(1), pin_threads(false) {}
             size_t num_threads;
         public:
             unsigned short port;
@@ -106,6 +164,12 @@ namespace SimpleWeb {
             std::string address;
             ///Set to false to avoid binding the socket to an address that is already in use.
             bool reuse_address;
+            ///Number of independent event loops.  With more than one, every loop gets its own
+            ///io_service, its own SO_REUSEPORT acceptor and exactly one thread, so no loop is
+            ///shared between threads and num_threads is ignored.
+            size_t num_loops;
+            ///Pin each event loop thread to its own CPU core (Linux only, needs num_loops>1).
+            bool pin_threads;
         };
         ///Set before calling start().
         Config config;
@@ -116,7 +180,19 @@ namespace SimpleWeb {
         std::unordered_map<std::string,
             std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > default_resource;
 
+        ///Routes that are tried before the regular expressions in resource, keyed on method.
+        ///The matcher is given the raw request path and fills in Request::path_values; it must
+        ///not allocate.  Requests taking this route skip building the header map, path and
+        ///remote endpoint, so their handlers only see method, http_version and path_values.
+        std::unordered_map<std::string, std::vector<std::pair<std::function<bool(const char*, const char*, Request&)>,
+            std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > > > fast_resource;
+
     private:
+        std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> bad_request_resource=
+            [](std::shared_ptr<typename ServerBase<socket_type>::Response> response, std::shared_ptr<typename ServerBase<socket_type>::Request>) {
+                *response << "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            };
+
         std::vector<std::pair<std::string, std::vector<std::pair<boost::regex,
             std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>, std::shared_ptr<typename ServerBase<socket_type>::Request>)> > > > > opt_resource;
 
@@ -142,31 +218,60 @@ namespace SimpleWeb {
                 }
             }
 
-            if(io_service.stopped())
-                io_service.reset();
-
             boost::asio::ip::tcp::endpoint endpoint;
             if(config.address.size()>0)
                 endpoint=boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(config.address), config.port);
             else
                 endpoint=boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), config.port);
-            acceptor.open(endpoint.protocol());
-            acceptor.set_option(boost::asio::socket_base::reuse_address(config.reuse_address));
-            acceptor.bind(endpoint);
-            acceptor.listen();
 
-            accept();
+            size_t num_loops=config.num_loops>0 ? config.num_loops : 1;
+#ifndef SO_REUSEPORT
+            //Without SO_REUSEPORT only one acceptor can be bound to the port
+            num_loops=1;
+#endif
+
+            //Every loop binds its own acceptor to the same port, the kernel then
+            //spreads incoming connections over them
+            loops.clear();
+            for(size_t c=0;c<num_loops;c++) {
+                loops.emplace_back(new Loop());
+                auto& acceptor=loops.back()->acceptor;
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(boost::asio::socket_base::reuse_address(config.reuse_address));
+#ifdef SO_REUSEPORT
+                if(num_loops>1)
+                    acceptor.set_option(reuse_port(true));
+#endif
+                acceptor.bind(endpoint);
+                acceptor.listen();
+
+                accept(*loops.back());
+            }
 
-            //If num_threads>1, start m_io_service.run() in (num_threads-1) threads for thread-pooling
             threads.clear();
-            for(size_t c=1;c<config.num_threads;c++) {
-                threads.emplace_back([this](){
-                    io_service.run();
-                });
+            if(num_loops==1) {
+                //If num_threads>1, start m_io_service.run() in (num_threads-1) threads for thread-pooling
+                for(size_t c=1;c<config.num_threads;c++) {
+                    threads.emplace_back([this](){
+                        loops[0]->io_service.run();
+                    });
+                }
+            }
+            else {
+                //One thread per loop, the main thread takes the first one
+                for(size_t c=1;c<num_loops;c++) {
+                    threads.emplace_back([this, c](){
+                        if(config.pin_threads)
+                            pin_to_core(c);
+                        loops[c]->io_service.run();
+                    });
+                }
+                if(config.pin_threads)
+                    pin_to_core(0);
             }
 
             //Main thread
-            io_service.run();
+            loops[0]->io_service.run();
 
             //Wait for the rest of the threads, if any, to finish as well
             for(auto& t: threads) {
@@ -175,33 +280,75 @@ namespace SimpleWeb {
         }
 
         void stop() {
-            acceptor.close();
-            io_service.stop();
+            for(auto& loop: loops) {
+                loop->acceptor.close();
+                loop->io_service.stop();
+            }
         }
 
         ///Use this function if you need to recursively send parts of a longer message
         void send(std::shared_ptr<Response> response, const std::function<void(const boost::system::error_code&)>& callback=nullptr) const {
-            boost::asio::async_write(*response->socket, response->streambuf, [this, response, callback](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
+            if(response->content_header==nullptr) {
+                boost::asio::async_write(*response->socket, response->streambuf, [this, response, callback](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
+                    if(callback)
+                        callback(ec);
+                });
+                return;
+            }
+
+            //Anything written to the stream goes first, then the set_content header and content
+            const auto streamed=response->streambuf.data();
+            const std::array<boost::asio::const_buffer, 4> buffers{{
+                boost::asio::const_buffer(boost::asio::buffer_cast<const void*>(streamed), boost::asio::buffer_size(streamed)),
+                boost::asio::const_buffer(response->content_header, response->content_header_size),
+                boost::asio::const_buffer(response->content_length, response->content_length_size),
+                response->content ? boost::asio::const_buffer(response->content->data(), response->content->size()) : boost::asio::const_buffer()
+            }};
+            boost::asio::async_write(*response->socket, buffers, [this, response, callback](const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
                 if(callback)
                     callback(ec);
             });
         }
 
     protected:
-        boost::asio::io_service io_service;
-        boost::asio::ip::tcp::acceptor acceptor;
+        ///An event loop: an io_service and the acceptor feeding it.  Connections accepted
+        ///by a loop are served by that loop's io_service for their whole lifetime.
+        struct Loop {
+            boost::asio::io_service io_service;
+            boost::asio::ip::tcp::acceptor acceptor;
+
+            Loop(): acceptor(io_service) {}
+        };
+
+#ifdef SO_REUSEPORT
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+        std::vector<std::unique_ptr<Loop>> loops;
         std::vector<std::thread> threads;
 
         long timeout_request;
         long timeout_content;
 
         ServerBase(unsigned short port, size_t num_threads, long timeout_request, long timeout_send_or_receive) :
-                config(port, num_threads), acceptor(io_service),
+                config(port, num_threads),
                 timeout_request(timeout_request), timeout_content(timeout_send_or_receive) {}
 
-        virtual void accept()=0;
+        virtual void accept(Loop& loop)=0;
+
+        static void pin_to_core(size_t index) {
+#ifdef __linux__
+            const auto cores=std::thread::hardware_concurrency();
+            if(cores==0)
+                return;
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(index%cores, &cpuset);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+#endif
+        }
 
-        std::shared_ptr<boost::asio::deadline_timer> set_timeout_on_socket(std::shared_ptr<socket_type> socket, long seconds) {
+        std::shared_ptr<boost::asio::deadline_timer> set_timeout_on_socket(boost::asio::io_service& io_service, std::shared_ptr<socket_type> socket, long seconds) {
             std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(io_service));
             timer->expires_from_now(boost::posix_time::seconds(seconds));
             timer->async_wait([socket](const boost::system::error_code& ec){
@@ -214,111 +361,163 @@ namespace SimpleWeb {
             return timer;
         }
 
-        void read_request_and_content(std::shared_ptr<socket_type> socket) {
+        void read_request_and_content(boost::asio::io_service& io_service, std::shared_ptr<socket_type> socket) {
             //Create new streambuf (Request::streambuf) for async_read_until()
             //shared_ptr is used to pass temporary objects to the asynchronous functions
             std::shared_ptr<Request> request(new Request());
-            request->read_remote_endpoint_data(*socket);
 
             //Set timeout on the following boost::asio::async-read or write function
             std::shared_ptr<boost::asio::deadline_timer> timer;
             if(timeout_request>0)
-                timer=set_timeout_on_socket(socket, timeout_request);
+                timer=set_timeout_on_socket(io_service, socket, timeout_request);
 
             boost::asio::async_read_until(*socket, request->streambuf, "\r\n\r\n",
-                    [this, socket, request, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
+                    [this, &io_service, socket, request, timer](const boost::system::error_code& ec, size_t bytes_transferred) {
                 if(timeout_request>0)
                     timer->cancel();
                 if(!ec) {
                     //request->streambuf.size() is not necessarily the same as bytes_transferred, from Boost-docs:
                     //"After a successful async_read_until operation, the streambuf may contain additional data beyond the delimiter"
-                    //The chosen solution is to extract lines from the stream directly when parsing the header. What is left of the
+                    //The chosen solution is to parse the header in place and then consume it from the streambuf. What is left of the
                     //streambuf (maybe some bytes of the content) is appended to in the async_read-function below (for retrieving content).
                     size_t num_additional_bytes=request->streambuf.size()-bytes_transferred;
 
-                    if(!parse_request(request, request->content))
+                    const char* header_begin=boost::asio::buffer_cast<const char*>(request->streambuf.data());
+                    if(!parse_request(*request, header_begin, header_begin+bytes_transferred)) {
+                        if(request->bad_request) {
+                            request->close_connection=true;
+                            write_response(io_service, socket, request, bad_request_resource);
+                        }
                         return;
+                    }
+                    request->streambuf.consume(bytes_transferred);
+
+                    if(request->fast_resource_function==nullptr)
+                        request->read_remote_endpoint_data(*socket);
 
                     //If content, read that as well
-                    auto it=request->header.find("Content-Length");
-                    if(it!=request->header.end()) {
+                    if(request->content_length>0) {
                         //Set timeout on the following boost::asio::async-read or write function
                         std::shared_ptr<boost::asio::deadline_timer> timer;
                         if(timeout_content>0)
-                            timer=set_timeout_on_socket(socket, timeout_content);
-                        unsigned long long content_length;
-                        try {
-                            content_length=stoull(it->second);
-                        }
-                        catch(const std::exception &) {
-                            return;
-                        }
+                            timer=set_timeout_on_socket(io_service, socket, timeout_content);
+                        const auto content_length=request->content_length;
                         if(content_length>num_additional_bytes) {
                             boost::asio::async_read(*socket, request->streambuf,
                                     boost::asio::transfer_exactly(content_length-num_additional_bytes),
-                                    [this, socket, request, timer]
+                                    [this, &io_service, socket, request, timer]
                                     (const boost::system::error_code& ec, size_t /*bytes_transferred*/) {
                                 if(timeout_content>0)
                                     timer->cancel();
                                 if(!ec)
-                                    find_resource(socket, request);
+                                    find_resource(io_service, socket, request);
                             });
                         }
                         else {
                             if(timeout_content>0)
                                 timer->cancel();
-                            find_resource(socket, request);
+                            find_resource(io_service, socket, request);
                         }
                     }
                     else {
-                        find_resource(socket, request);
+                        find_resource(io_service, socket, request);
                     }
                 }
             });
         }
 
-        bool parse_request(std::shared_ptr<Request> request, std::istream& stream) const {
-            std::string line;
-            getline(stream, line);
-            size_t method_end;
-            if((method_end=line.find(' '))!=std::string::npos) {
-                size_t path_end;
-                if((path_end=line.find(' ', method_end+1))!=std::string::npos) {
-                    request->method=line.substr(0, method_end);
-                    request->path=line.substr(method_end+1, path_end-method_end-1);
-
-                    size_t protocol_end;
-                    if((protocol_end=line.find('/', path_end+1))!=std::string::npos) {
-                        if(line.substr(path_end+1, protocol_end-path_end-1)!="HTTP")
-                            return false;
-                        request->http_version=line.substr(protocol_end+1, line.size()-protocol_end-2);
+        //Parses the request line and header fields in place.  [begin, end) is everything up to and
+        //including the empty line that ends the header.
+        bool parse_request(Request& request, const char* begin, const char* end) {
+            const char* line_end=std::find(begin, end, '\n');
+            const char* line_last=line_end;
+            if(line_last>begin && *(line_last-1)=='\r')
+                line_last--;
+
+            const char* method_end=std::find(begin, line_last, ' ');
+            if(method_end==line_last)
+                return false;
+            const char* path_begin=method_end+1;
+            const char* path_end=std::find(path_begin, line_last, ' ');
+            if(path_end==line_last)
+                return false;
+            const char* protocol_end=std::find(path_end+1, line_last, '/');
+            if(protocol_end==line_last)
+                return false;
+            static const char protocol[]="HTTP";
+            if(protocol_end-(path_end+1)!=sizeof(protocol)-1 || !std::equal(path_end+1, protocol_end, protocol))
+                return false;
+            request.method.assign(begin, method_end);
+            request.http_version.assign(protocol_end+1, line_last);
+
+            auto it_method=fast_resource.find(request.method);
+            if(it_method!=fast_resource.end()) {
+                for(auto& res_path: it_method->second) {
+                    if(res_path.first(path_begin, path_end, request)) {
+                        request.fast_resource_function=&res_path.second;
+                        break;
                     }
-                    else
+                }
+            }
+            const bool fast=request.fast_resource_function!=nullptr;
+            if(!fast)
+                request.path.assign(path_begin, path_end);
+
+            for(const char* line=line_end+1;line<end;line=line_end+1) {
+                line_end=std::find(line, end, '\n');
+                line_last=line_end;
+                if(line_last>line && *(line_last-1)=='\r')
+                    line_last--;
+                const char* param_end=std::find(line, line_last, ':');
+                if(param_end==line_last)
+                    break;
+                const char* value_start=param_end+1;
+                if(value_start<line_last && *value_start==' ')
+                    value_start++;
+                if(value_start>=line_last)
+                    continue;
+
+                if(field_equals(line, param_end, "Content-Length")) {
+                    //At most 19 digits always fit, more could wrap around to any length
+                    if(line_last-value_start>19) {
+                        request.bad_request=true;
                         return false;
-
-                    getline(stream, line);
-                    size_t param_end;
-                    while((param_end=line.find(':'))!=std::string::npos) {
-                        size_t value_start=param_end+1;
-                        if((value_start)<line.size()) {
-                            if(line[value_start]==' ')
-                                value_start++;
-                            if(value_start<line.size())
-                                request->header.insert(std::make_pair(line.substr(0, param_end), line.substr(value_start, line.size()-value_start-1)));
+                    }
+                    unsigned long long content_length=0;
+                    for(const char* c=value_start;c!=line_last;c++) {
+                        if(*c<'0' || *c>'9') {
+                            request.bad_request=true;
+                            return false;
                         }
-
-                        getline(stream, line);
+                        content_length=content_length*10+(*c-'0');
                     }
+                    request.content_length=content_length;
                 }
-                else
-                    return false;
+                else if(field_equals(line, param_end, "Connection") && field_equals(value_start, line_last, "close"))
+                    request.close_connection=true;
+
+                if(!fast)
+                    request.header.insert(std::make_pair(std::string(line, param_end), std::string(value_start, line_last)));
             }
-            else
-                return false;
             return true;
         }
 
-        void find_resource(std::shared_ptr<socket_type> socket, std::shared_ptr<Request> request) {
+        //Case insensitive comparison of [begin, end) against a header name or value
+        static bool field_equals(const char* begin, const char* end, const char* name) {
+            for(;begin!=end;begin++, name++) {
+                if(*name=='\0' || std::tolower(static_cast<unsigned char>(*begin))!=std::tolower(static_cast<unsigned char>(*name)))
+                    return false;
+            }
+            return *name=='\0';
+        }
+
+        void find_resource(boost::asio::io_service& io_service, std::shared_ptr<socket_type> socket, std::shared_ptr<Request> request) {
+            //Already matched by a fast_resource route while parsing
+            if(request->fast_resource_function!=nullptr) {
+                write_response(io_service, socket, request, *request->fast_resource_function);
+                return;
+            }
+
             //Find path- and method-match, and call write_response
             for(auto& res: opt_resource) {
                 if(request->method==res.first) {
@@ -326,7 +525,7 @@ namespace SimpleWeb {
                         boost::smatch sm_res;
                         if(boost::regex_match(request->path, sm_res, res_path.first)) {
                             request->path_match=std::move(sm_res);
-                            write_response(socket, request, res_path.second);
+                            write_response(io_service, socket, request, res_path.second);
                             return;
                         }
                     }
@@ -334,19 +533,19 @@ namespace SimpleWeb {
             }
             auto it_method=default_resource.find(request->method);
             if(it_method!=default_resource.end()) {
-                write_response(socket, request, it_method->second);
+                write_response(io_service, socket, request, it_method->second);
             }
         }
 
-        void write_response(std::shared_ptr<socket_type> socket, std::shared_ptr<Request> request,
+        void write_response(boost::asio::io_service& io_service, std::shared_ptr<socket_type> socket, std::shared_ptr<Request> request,
                 std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Response>,
                                    std::shared_ptr<typename ServerBase<socket_type>::Request>)>& resource_function) {
             //Set timeout on the following boost::asio::async-read or write function
             std::shared_ptr<boost::asio::deadline_timer> timer;
             if(timeout_content>0)
-                timer=set_timeout_on_socket(socket, timeout_content);
+                timer=set_timeout_on_socket(io_service, socket, timeout_content);
 
-            auto response=std::shared_ptr<Response>(new Response(socket), [this, request, timer](Response *response_ptr) {
+            auto response=std::shared_ptr<Response>(new Response(socket, io_service), [this, request, timer](Response *response_ptr) {
                 auto response=std::shared_ptr<Response>(response_ptr);
                 send(response, [this, response, request, timer](const boost::system::error_code& ec) {
                     if(!ec) {
@@ -360,13 +559,10 @@ namespace SimpleWeb {
                             return;
                         }
 
-                        auto range=request->header.equal_range("Connection");
-                        for(auto it=range.first;it!=range.second;it++) {
-                            if(boost::iequals(it->second, "close"))
-                                return;
-                        }
+                        if(request->close_connection)
+                            return;
                         if(http_version>1.05)
-                            read_request_and_content(response->socket);
+                            read_request_and_content(response->io_service, response->socket);
                     }
                 });
             });
@@ -392,20 +588,20 @@ namespace SimpleWeb {
                 ServerBase<HTTP>::ServerBase(port, num_threads, timeout_request, timeout_content) {}
 
     protected:
-        void accept() {
+        void accept(Loop& loop) {
             //Create new socket for this connection
             //Shared_ptr is used to pass temporary objects to the asynchronous functions
-            std::shared_ptr<HTTP> socket(new HTTP(io_service));
+            std::shared_ptr<HTTP> socket(new HTTP(loop.io_service));
 
-            acceptor.async_accept(*socket, [this, socket](const boost::system::error_code& ec){
+            loop.acceptor.async_accept(*socket, [this, &loop, socket](const boost::system::error_code& ec){
                 //Immediately start accepting a new connection
-                accept();
+                accept(loop);
 
                 if(!ec) {
                     boost::asio::ip::tcp::no_delay option(true);
                     socket->set_option(option);
 
-                    read_request_and_content(socket);
+                    read_request_and_content(loop.io_service, socket);
                 }
             });
         }
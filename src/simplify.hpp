@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "tile.hpp"
+
+namespace util { namespace tile {
+
+// Tile units per pixel of a tile displayed at TILE_SIZE pixels
+const constexpr std::int32_t PIXEL = static_cast<std::int32_t>(util::vector_tile::EXTENT / util::web_mercator::TILE_SIZE);
+
+// How far, in tile units, simplification may move a line at zoom z.  A whole
+// pixel up to z12, where lines are mostly seen from far away, halving with
+// each zoom level after that, so the deepest tiles keep full precision.
+inline double simplifyTolerance(const int z)
+{
+    const int halvings = std::max(0, z - 12);
+    return std::max(1., static_cast<double>(PIXEL) / static_cast<double>(1 << halvings));
+}
+
+// Removes points that repeat the one before them
+inline void removeRepeatedPoints(tile_linestring_t &line)
+{
+    const tile_point_equal equal;
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < line.size(); ++i)
+    {
+        if (kept > 0 && equal(line[kept - 1], line[i])) continue;
+        line[kept++] = line[i];
+    }
+    line.resize(kept);
+}
+
+inline double lineLength(const tile_linestring_t &line)
+{
+    double length = 0;
+    for (std::size_t i = 1; i < line.size(); ++i)
+    {
+        length += std::hypot(static_cast<double>(line[i].get<0>()) - line[i - 1].get<0>(),
+                             static_cast<double>(line[i].get<1>()) - line[i - 1].get<1>());
+    }
+    return length;
+}
+
+namespace detail {
+// Squared distance from p to the segment a-b
+inline double squaredSegmentDistance(const tile_point_t &p, const tile_point_t &a, const tile_point_t &b)
+{
+    const double dx = static_cast<double>(b.get<0>()) - a.get<0>();
+    const double dy = static_cast<double>(b.get<1>()) - a.get<1>();
+    double x = a.get<0>();
+    double y = a.get<1>();
+    const double length2 = dx * dx + dy * dy;
+    if (length2 > 0)
+    {
+        const double t = ((p.get<0>() - x) * dx + (p.get<1>() - y) * dy) / length2;
+        if (t >= 1)
+        {
+            x = b.get<0>();
+            y = b.get<1>();
+        }
+        else if (t > 0)
+        {
+            x += t * dx;
+            y += t * dy;
+        }
+    }
+    const double px = p.get<0>() - x;
+    const double py = p.get<1>() - y;
+    return px * px + py * py;
+}
+}
+
+/**
+ * Douglas-Peucker simplification of line in place: drops every point that is
+ * within tolerance of the simplified line, always keeping both ends.  stack
+ * and keep are working space, passed in so they can be reused.
+ **/
+inline void simplifyLine(tile_linestring_t &line,
+                         const double tolerance,
+                         std::vector<std::pair<std::uint32_t, std::uint32_t>> &stack,
+                         std::vector<std::uint8_t> &keep)
+{
+    const auto num_points = static_cast<std::uint32_t>(line.size());
+    if (num_points < 3) return;
+
+    const double tolerance2 = tolerance * tolerance;
+    keep.assign(num_points, 0);
+    keep[0] = keep[num_points - 1] = 1;
+    stack.clear();
+    stack.emplace_back(0, num_points - 1);
+    while (!stack.empty())
+    {
+        const auto first = stack.back().first;
+        const auto last = stack.back().second;
+        stack.pop_back();
+
+        double max_distance2 = 0;
+        std::uint32_t farthest = first;
+        for (auto i = first + 1; i < last; ++i)
+        {
+            const double distance2 = detail::squaredSegmentDistance(line[i], line[first], line[last]);
+            if (distance2 > max_distance2)
+            {
+                max_distance2 = distance2;
+                farthest = i;
+            }
+        }
+
+        if (max_distance2 > tolerance2)
+        {
+            keep[farthest] = 1;
+            if (farthest - first > 1) stack.emplace_back(first, farthest);
+            if (last - farthest > 1) stack.emplace_back(farthest, last);
+        }
+    }
+
+    std::size_t kept = 0;
+    for (std::uint32_t i = 0; i < num_points; ++i)
+    {
+        if (keep[i]) line[kept++] = line[i];
+    }
+    line.resize(kept);
+}
+
+} }
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "array.hpp"
+#include "mapped_file.hpp"
+
+namespace util { namespace snapshot {
+
+/**
+ * A file of named arrays, laid out so it can be mapped and used in place.
+ *
+ * The file starts with a header, and the sections follow, each aligned to
+ * ALIGNMENT bytes so any element type can be read where it lies.  A table
+ * of the sections comes last, giving each one's name, where it is, its
+ * element size and a CRC32 of its bytes.  The header and the table have
+ * CRC32s of their own.
+ *
+ * Elements are written as they are in memory, so a snapshot is only good
+ * for the layout of the code that wrote it: the header records VERSION,
+ * which has to go up whenever a saved type changes, and the byte order.
+ * Element sizes are checked on every read as a backstop.
+ **/
+const constexpr char MAGIC[8] = {'T', 'R', 'A', 'F', 'S', 'N', 'A', 'P'};
+const constexpr std::uint32_t VERSION = 1;
+const constexpr std::uint32_t ENDIAN_MARK = 0x01020304;
+const constexpr std::size_t ALIGNMENT = 64;
+const constexpr std::size_t MAX_NAME = 40;
+
+namespace detail {
+struct header_t {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t file_size;
+    std::uint64_t table_offset;
+    std::uint32_t num_sections;
+    std::uint32_t table_crc;
+    // Of everything above
+    std::uint32_t header_crc;
+    std::uint8_t padding[20];
+};
+static_assert(sizeof(header_t) == ALIGNMENT, "the header fills one alignment unit");
+
+struct section_t {
+    char name[MAX_NAME];
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::uint32_t element_size;
+    std::uint32_t crc;
+};
+static_assert(sizeof(section_t) == 64, "section entries are packed");
+
+// zlib's crc32 takes at most a uInt of bytes at a time
+inline std::uint32_t crc(const void *data, std::size_t size, std::uint32_t value = 0)
+{
+    const auto *bytes = static_cast<const Bytef *>(data);
+    while (size > 0)
+    {
+        const auto length = static_cast<uInt>(std::min<std::size_t>(size, 1u << 30));
+        value = static_cast<std::uint32_t>(crc32(value, bytes, length));
+        bytes += length;
+        size -= length;
+    }
+    return value;
+}
+
+inline std::uint32_t headerCrc(const header_t &header)
+{
+    return crc(&header, offsetof(header_t, header_crc));
+}
+}
+
+/**
+ * Writes a snapshot to path + ".tmp", and renames it over path once it's
+ * complete and on disk, so a server never maps a half written one.  The
+ * temporary file is removed if the writer is destroyed before commit().
+ **/
+class Writer {
+  public:
+    explicit Writer(const std::string &path) : path(path), temp_path(path + ".tmp"), offset(0)
+    {
+        file = std::fopen(temp_path.c_str(), "wb");
+        if (file == nullptr) fail(temp_path);
+        const detail::header_t header{};
+        write(&header, sizeof(header));
+    }
+
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    ~Writer()
+    {
+        if (file != nullptr)
+        {
+            std::fclose(file);
+            std::remove(temp_path.c_str());
+        }
+    }
+
+    template <typename T> void add(const std::string &name, const T *data, const std::size_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be mapped back in");
+        if (name.size() >= MAX_NAME) throw std::invalid_argument("snapshot section name too long: " + name);
+        for (const auto &section : sections)
+        {
+            if (name == section.name) throw std::invalid_argument("snapshot section added twice: " + name);
+        }
+
+        align();
+        detail::section_t section{};
+        std::memcpy(section.name, name.data(), name.size());
+        section.offset = offset;
+        section.size = count * sizeof(T);
+        section.element_size = sizeof(T);
+        section.crc = detail::crc(data, section.size);
+        write(data, section.size);
+        sections.push_back(section);
+    }
+
+    template <typename T> void add(const std::string &name, const std::vector<T> &elements) { add(name, elements.data(), elements.size()); }
+    template <typename T> void add(const std::string &name, const Array<T> &elements) { add(name, elements.data(), elements.size()); }
+    template <typename T> void addValue(const std::string &name, const T &value) { add(name, &value, 1); }
+
+    // Writes the section table and the header, and moves the file into place
+    void commit()
+    {
+        align();
+        detail::header_t header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.byte_order = ENDIAN_MARK;
+        header.table_offset = offset;
+        header.num_sections = static_cast<std::uint32_t>(sections.size());
+        header.table_crc = detail::crc(sections.data(), sections.size() * sizeof(detail::section_t));
+        write(sections.data(), sections.size() * sizeof(detail::section_t));
+        header.file_size = offset;
+        header.header_crc = detail::headerCrc(header);
+
+        // Over the blank one the constructor left room with
+        if (std::fseek(file, 0, SEEK_SET) != 0 || std::fwrite(&header, sizeof(header), 1, file) != 1) fail(temp_path);
+        if (std::fflush(file) != 0 || fsync(fileno(file)) != 0) fail(temp_path);
+        const int closed = std::fclose(file);
+        file = nullptr;
+        if (closed != 0) fail(temp_path);
+        if (std::rename(temp_path.c_str(), path.c_str()) != 0) fail(path);
+    }
+
+    // Bytes written so far
+    std::uint64_t size() const { return offset; }
+
+  private:
+    void write(const void *data, const std::size_t size)
+    {
+        if (size > 0 && std::fwrite(data, 1, size, file) != size) fail(temp_path);
+        offset += size;
+    }
+
+    void align()
+    {
+        static const char zeros[ALIGNMENT] = {};
+        write(zeros, (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT);
+    }
+
+    static void fail(const std::string &path)
+    {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+
+    std::string path;
+    std::string temp_path;
+    std::FILE *file;
+    std::uint64_t offset;
+    std::vector<detail::section_t> sections;
+};
+
+/**
+ * A snapshot mapped read-only.  Everything is checked up front: the header,
+ * that the file is whole, and every section's checksum, which also reads
+ * the file into the page cache, where it's shared with any other process
+ * mapping the same file.  After that, sections are handed out as views
+ * straight into the mapping, which must outlive them.
+ **/
+class Reader {
+  public:
+    explicit Reader(const std::string &path) : path(path), file(path)
+    {
+        detail::header_t header;
+        if (file.size() < sizeof(header)) fail("too short to be a snapshot");
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) fail("not a snapshot");
+        if (header.byte_order != ENDIAN_MARK) fail("written on a machine with another byte order");
+        if (header.version != VERSION)
+        {
+            fail("snapshot version " + std::to_string(header.version) + ", this server reads version " + std::to_string(VERSION) + ", rebuild it");
+        }
+        if (header.header_crc != detail::headerCrc(header)) fail("header checksum mismatch");
+        if (header.file_size != file.size()) fail("truncated, or not completely written");
+
+        const auto table_size = std::uint64_t{header.num_sections} * sizeof(detail::section_t);
+        if (header.table_offset % ALIGNMENT != 0 || header.table_offset > file.size() || table_size > file.size() - header.table_offset)
+        {
+            fail("section table out of bounds");
+        }
+        sections = reinterpret_cast<const detail::section_t *>(file.data() + header.table_offset);
+        num_sections = header.num_sections;
+        if (detail::crc(sections, table_size) != header.table_crc) fail("section table checksum mismatch");
+
+        for (std::size_t i = 0; i < num_sections; ++i)
+        {
+            const auto &section = sections[i];
+            const std::string name = sectionName(section);
+            if (section.offset % ALIGNMENT != 0 || section.offset > header.table_offset || section.size > header.table_offset - section.offset)
+            {
+                fail("section " + name + " out of bounds");
+            }
+            if (detail::crc(file.data() + section.offset, section.size) != section.crc) fail("section " + name + " checksum mismatch");
+        }
+    }
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    // True if path starts like a snapshot, to tell them from map files
+    static bool isSnapshot(const std::string &path)
+    {
+        char magic[sizeof(MAGIC)];
+        std::FILE *file = std::fopen(path.c_str(), "rb");
+        if (file == nullptr) return false;
+        const bool read = std::fread(magic, 1, sizeof(magic), file) == sizeof(magic);
+        std::fclose(file);
+        return read && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    template <typename T> Array<T> array(const std::string &name) const
+    {
+        const auto &section = find(name);
+        if (section.element_size != sizeof(T) || section.size % sizeof(T) != 0)
+        {
+            fail("section " + name + " has " + std::to_string(section.element_size) + " byte elements, expected " + std::to_string(sizeof(T)));
+        }
+        return Array<T>::view(reinterpret_cast<const T *>(file.data() + section.offset), static_cast<std::size_t>(section.size / sizeof(T)));
+    }
+
+    template <typename T> T value(const std::string &name) const
+    {
+        const auto elements = array<T>(name);
+        if (elements.size() != 1) fail("section " + name + " should hold a single value");
+        return elements[0];
+    }
+
+    std::size_t size() const { return file.size(); }
+
+  private:
+    const detail::section_t &find(const std::string &name) const
+    {
+        for (std::size_t i = 0; i < num_sections; ++i)
+        {
+            if (sectionName(sections[i]) == name) return sections[i];
+        }
+        fail("no section " + name);
+    }
+
+    static std::string sectionName(const detail::section_t &section)
+    {
+        return std::string(section.name, strnlen(section.name, MAX_NAME));
+    }
+
+    [[noreturn]] void fail(const std::string &message) const
+    {
+        throw std::runtime_error(path + ": " + message);
+    }
+
+    std::string path;
+    MappedFile file;
+    const detail::section_t *sections;
+    std::size_t num_sections;
+};
+
+} }
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+#include "speeds.hpp"
+
+namespace util { namespace speeds {
+
+/**
+ * Sorts segments into congestion bins by how their current speed compares
+ * to their free flow speed.  Bins are given from the least congested to the
+ * most, each with the smallest ratio of current to free flow speed that
+ * still belongs in it.  Bin 0 is always "unknown", for segments missing
+ * either speed, and the configured ones follow, so a higher bin is always
+ * more congested.
+ *
+ * Speeds are bytes, so every possible pair of them is binned up front, and
+ * binning a segment is a lookup in a 64KB table.
+ **/
+class SpeedBins {
+  public:
+    typedef std::uint8_t bin_t;
+    static const constexpr bin_t UNKNOWN = 0;
+
+    // bins are (name, minimum current/freeflow ratio), from least to most
+    // congested, with falling ratios
+    explicit SpeedBins(const std::vector<std::pair<std::string, double>> &bins) : names{"unknown"}, table(256 * 256, bin_t{UNKNOWN})
+    {
+        if (bins.empty() || bins.size() > 254) throw std::invalid_argument("between 1 and 254 speed bins are needed");
+        for (std::size_t i = 1; i < bins.size(); ++i)
+        {
+            if (bins[i].second >= bins[i - 1].second) throw std::invalid_argument("speed bin ratios must fall from one bin to the next");
+        }
+        for (const auto &bin : bins) names.push_back(bin.first);
+
+        for (unsigned freeflow = 1; freeflow <= MAX_SPEED; ++freeflow)
+        {
+            for (unsigned current = 0; current <= MAX_SPEED; ++current)
+            {
+                const double ratio = static_cast<double>(current) / freeflow;
+                // Slower than every bin allows goes in the last one
+                bin_t bin = static_cast<bin_t>(bins.size());
+                for (std::size_t i = 0; i < bins.size(); ++i)
+                {
+                    if (ratio >= bins[i].second)
+                    {
+                        bin = static_cast<bin_t>(i + 1);
+                        break;
+                    }
+                }
+                table[freeflow << 8 | current] = bin;
+            }
+        }
+    }
+
+    // The bins from README: free flowing down to stopped
+    static SpeedBins defaults()
+    {
+        return SpeedBins({{"uncongested", 0.75}, {"slightly slow", 0.5}, {"very slow", 0.25}, {"stopped", 0.}});
+    }
+
+    bin_t bin(const speed_t freeflow, const speed_t current) const
+    {
+        return table[static_cast<unsigned>(freeflow) << 8 | current];
+    }
+
+    // The more congested direction of an edge
+    bin_t edgeBin(const SpeedTable &freeflow, const SpeedTable &current, const edge_id_t edge) const
+    {
+        return std::max(bin(freeflow.forward[edge], current.forward[edge]), bin(freeflow.reverse[edge], current.reverse[edge]));
+    }
+
+    // Number of bins, counting unknown
+    std::size_t size() const { return names.size(); }
+    const std::string &name(const bin_t bin) const { return names[bin]; }
+
+  private:
+    std::vector<std::string> names;
+    // Indexed by freeflow << 8 | current, where either speed can be NO_SPEED
+    std::vector<bin_t> table;
+};
+
+} }
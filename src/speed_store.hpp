@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "speeds.hpp"
+
+namespace util { namespace speeds {
+
+/**
+ * Current speeds that can be updated while tiles are rendered from them.
+ *
+ * There are two copies of the speed table.  Readers take a snapshot of the
+ * published one and see exactly that generation of speeds until they let go
+ * of it, without ever taking a lock.  An update is written into the other
+ * copy, which nobody is reading, and then published with a single atomic
+ * store of the generation number, whose lowest bit picks the copy.
+ *
+ * Each copy counts the snapshots holding it.  A reader registers with the
+ * copy it was told is published, then checks the generation again: if it
+ * changed in between, the reader may have registered with the copy about to
+ * be written, so it backs off and tries again.  Writers wait for the copy
+ * they're about to write to have no readers.  That only happens when a
+ * render still holds the generation before last, so it's short.
+ *
+ * The copy being written missed the previous update, which went into the
+ * other one, so that's replayed first.  Keeping the last update around that
+ * way bounds the memory to two tables plus one update, and makes an update
+ * cost as much as its size, not the whole table.
+ **/
+class SpeedStore {
+  public:
+    // A consistent view of one generation of speeds, held until destroyed
+    class Snapshot {
+      public:
+        Snapshot(Snapshot &&other) : readers(other.readers), table_(other.table_), generation_(other.generation_)
+        {
+            other.readers = nullptr;
+        }
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+        Snapshot &operator=(Snapshot &&) = delete;
+
+        ~Snapshot()
+        {
+            if (readers != nullptr) readers->fetch_sub(1);
+        }
+
+        const SpeedTable &table() const { return *table_; }
+        std::uint64_t generation() const { return generation_; }
+
+      private:
+        friend class SpeedStore;
+        Snapshot(std::atomic<std::size_t> *readers, const SpeedTable *table, const std::uint64_t generation)
+            : readers(readers), table_(table), generation_(generation)
+        {
+        }
+
+        std::atomic<std::size_t> *readers;
+        const SpeedTable *table_;
+        std::uint64_t generation_;
+    };
+
+    explicit SpeedStore(SpeedTable initial) : generation_(0)
+    {
+        tables[1] = initial;
+        tables[0] = std::move(initial);
+        readers[0] = 0;
+        readers[1] = 0;
+    }
+
+    SpeedStore(const SpeedStore &) = delete;
+    SpeedStore &operator=(const SpeedStore &) = delete;
+
+    Snapshot snapshot()
+    {
+        for (;;)
+        {
+            const auto generation = generation_.load();
+            auto &count = readers[generation & 1];
+            count.fetch_add(1);
+            if (generation_.load() == generation) return Snapshot(&count, &tables[generation & 1], generation);
+            count.fetch_sub(1);
+        }
+    }
+
+    std::uint64_t generation() const { return generation_.load(); }
+
+    // Applies updates, in order, as one new generation, and returns it.
+    // Updates from several threads are applied one after another.
+    std::uint64_t apply(std::vector<update_t> updates)
+    {
+        return apply(std::move(updates), [](const SpeedTable &, const SpeedTable &, const std::vector<update_t> &) {});
+    }
+
+    // As above, calling inspect(before, after, updates) with the published
+    // speeds and the new ones just before the new ones are published
+    template <typename Inspect> std::uint64_t apply(std::vector<update_t> updates, Inspect inspect)
+    {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        const auto next = generation_.load() + 1;
+        auto &table = tables[next & 1];
+        auto &count = readers[next & 1];
+        while (count.load() != 0) std::this_thread::yield();
+
+        for (const auto &update : last_updates) table.set(update.edge, update.reversed, update.speed);
+        for (const auto &update : updates) table.set(update.edge, update.reversed, update.speed);
+        const auto &published = tables[(next - 1) & 1];
+        const auto &written = table;
+        inspect(published, written, static_cast<const std::vector<update_t> &>(updates));
+
+        generation_.store(next);
+        last_updates = std::move(updates);
+        return next;
+    }
+
+    // Waits until every snapshot older than generation has been let go of.
+    // Only the published generation and the one before can be held, as a
+    // writer waits out the one before that.
+    void waitForSnapshotsBefore(const std::uint64_t generation) const
+    {
+        for (;;)
+        {
+            const auto current = generation_.load();
+            if (current > generation || readers[(current + 1) & 1].load() == 0) return;
+            std::this_thread::yield();
+        }
+    }
+
+  private:
+    SpeedTable tables[2];
+    std::atomic<std::size_t> readers[2];
+    std::atomic<std::uint64_t> generation_;
+
+    // Serialises writers, readers never touch it
+    std::mutex update_mutex;
+    // Applied to the published table, but not the other one yet
+    std::vector<update_t> last_updates;
+};
+
+} }
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "edge_lookup.hpp"
+#include "mapped_file.hpp"
+
+namespace util { namespace speeds {
+
+// Speeds are whole km/h, which a byte holds for any road
+typedef std::uint8_t speed_t;
+const constexpr speed_t MAX_SPEED = 254;
+// No speed is known for that direction of the edge
+const constexpr speed_t NO_SPEED = 255;
+
+/**
+ * A speed per edge and direction, indexed by edge id.  forward is the speed
+ * travelling the edge the way the way's nodes run, reverse the other way.
+ **/
+struct SpeedTable {
+    std::vector<speed_t> forward;
+    std::vector<speed_t> reverse;
+
+    SpeedTable() = default;
+    explicit SpeedTable(const std::size_t num_edges) : forward(num_edges, NO_SPEED), reverse(num_edges, NO_SPEED) {}
+
+    void set(const edge_id_t edge, const bool reversed, const speed_t speed)
+    {
+        (reversed ? reverse : forward)[edge] = speed;
+    }
+};
+
+// A new speed for one direction of an edge
+struct update_t {
+    edge_id_t edge;
+    bool reversed;
+    speed_t speed;
+};
+
+struct load_stats_t {
+    // Rows that parsed
+    std::uint64_t rows = 0;
+    // Of those, rows that matched no edge
+    std::uint64_t unmatched = 0;
+    // Lines that weren't a row at all, like a header
+    std::uint64_t malformed = 0;
+    // Edge directions set, which can be more than rows when edges overlap
+    std::uint64_t updates = 0;
+
+    load_stats_t &operator+=(const load_stats_t &other)
+    {
+        rows += other.rows;
+        unmatched += other.unmatched;
+        malformed += other.malformed;
+        updates += other.updates;
+        return *this;
+    }
+};
+
+namespace detail {
+struct row_t {
+    std::uint64_t from;
+    std::uint64_t to;
+    speed_t speed;
+};
+
+inline const char *parseUnsigned(const char *p, const char *end, std::uint64_t &value)
+{
+    const char *start = p;
+    value = 0;
+    while (p != end && *p >= '0' && *p <= '9')
+    {
+        value = value * 10 + static_cast<std::uint64_t>(*p - '0');
+        ++p;
+    }
+    return p == start ? nullptr : p;
+}
+
+// Parses one line, without its newline, as nodeA,nodeB,speed.  Speeds may
+// have a fraction, which is rounded, and any further columns are ignored.
+inline bool parseRow(const char *p, const char *end, row_t &row)
+{
+    p = parseUnsigned(p, end, row.from);
+    if (p == nullptr || p == end || *p != ',') return false;
+    p = parseUnsigned(p + 1, end, row.to);
+    if (p == nullptr || p == end || *p != ',') return false;
+    std::uint64_t speed;
+    p = parseUnsigned(p + 1, end, speed);
+    if (p == nullptr) return false;
+    if (p != end && *p == '.')
+    {
+        ++p;
+        if (p != end && *p >= '5' && *p <= '9') ++speed;
+        while (p != end && *p >= '0' && *p <= '9') ++p;
+    }
+    if (p != end && *p != ',' && *p != '\r') return false;
+    row.speed = static_cast<speed_t>(std::min<std::uint64_t>(speed, MAX_SPEED));
+    return true;
+}
+
+// Parses the whole lines in [begin, end) into the edge updates they make.
+// Rows are looked up ROW_BATCH at a time, see EdgeLookup::forEachBatch.
+inline load_stats_t parseBlock(const char *begin, const char *end, const EdgeLookup &lookup, std::vector<update_t> &updates)
+{
+    static const constexpr std::size_t ROW_BATCH = 256;
+    nodepair_t pairs[ROW_BATCH];
+    speed_t speeds[ROW_BATCH];
+    std::size_t num_rows = 0;
+
+    load_stats_t stats;
+    updates.clear();
+    const auto resolve = [&]() {
+        std::size_t matched = 0;
+        std::size_t last = ROW_BATCH;
+        lookup.forEachBatch(pairs, num_rows, [&](const std::size_t i, const edge_id_t edge, const bool reversed) {
+            updates.push_back({edge, reversed, speeds[i]});
+            matched += i != last;
+            last = i;
+        });
+        stats.unmatched += num_rows - matched;
+        num_rows = 0;
+    };
+
+    row_t row;
+    for (const char *line = begin; line < end;)
+    {
+        const char *newline = static_cast<const char *>(std::memchr(line, '\n', static_cast<std::size_t>(end - line)));
+        const char *line_end = newline == nullptr ? end : newline;
+        if (line_end == line || (line_end - line == 1 && *line == '\r'))
+        {
+            // Blank lines don't count for anything
+        }
+        else if (!parseRow(line, line_end, row))
+        {
+            ++stats.malformed;
+        }
+        else
+        {
+            ++stats.rows;
+            pairs[num_rows] = nodepair_t(row.from, row.to);
+            speeds[num_rows] = row.speed;
+            if (++num_rows == ROW_BATCH) resolve();
+        }
+        line = line_end + 1;
+    }
+    resolve();
+    stats.updates = updates.size();
+    return stats;
+}
+
+// Splits [data, data + size) into blocks of about block_size bytes that end
+// on line boundaries
+inline std::vector<std::pair<const char *, const char *>> splitLines(const char *data, const std::size_t size, const std::size_t block_size)
+{
+    std::vector<std::pair<const char *, const char *>> blocks;
+    const char *end = data + size;
+    for (const char *begin = data; begin < end;)
+    {
+        const char *block_end = end;
+        if (static_cast<std::size_t>(end - begin) > block_size)
+        {
+            const char *newline = static_cast<const char *>(std::memchr(begin + block_size, '\n', static_cast<std::size_t>(end - begin - block_size)));
+            if (newline != nullptr) block_end = newline + 1;
+        }
+        blocks.emplace_back(begin, block_end);
+        begin = block_end;
+    }
+    return blocks;
+}
+}
+
+/**
+ * Parses nodeA,nodeB,speed rows from [data, data + size) into edge updates.
+ * The text is cut into blocks on line boundaries that are parsed num_threads
+ * at a time, each thread turning its block into a list of updates.  Between
+ * rounds, apply is called with each block's updates in turn, so it sees them
+ * in the order of the rows, and if an edge is listed more than once the last
+ * row wins, just as if the text were read from start to end.
+ **/
+template <typename Apply>
+load_stats_t parseSpeeds(const char *data, const std::size_t size, const EdgeLookup &lookup, std::size_t num_threads,
+                         Apply apply, const std::size_t block_size = 16 * 1024 * 1024)
+{
+    if (num_threads == 0) num_threads = 1;
+    const auto blocks = detail::splitLines(data, size, block_size);
+
+    load_stats_t stats;
+    std::vector<std::vector<update_t>> updates(num_threads);
+    std::vector<load_stats_t> block_stats(num_threads);
+    std::vector<std::thread> threads;
+    for (std::size_t round = 0; round < blocks.size(); round += num_threads)
+    {
+        const auto round_size = std::min(num_threads, blocks.size() - round);
+        if (round_size == 1)
+        {
+            // Not worth a thread
+            block_stats[0] = detail::parseBlock(blocks[round].first, blocks[round].second, lookup, updates[0]);
+        }
+        else
+        {
+            threads.clear();
+            for (std::size_t i = 0; i < round_size; ++i)
+            {
+                threads.emplace_back([&, i]() {
+                    const auto &block = blocks[round + i];
+                    block_stats[i] = detail::parseBlock(block.first, block.second, lookup, updates[i]);
+                });
+            }
+            for (auto &thread : threads) thread.join();
+        }
+
+        for (std::size_t i = 0; i < round_size; ++i)
+        {
+            apply(static_cast<const std::vector<update_t> &>(updates[i]));
+            stats += block_stats[i];
+        }
+    }
+    return stats;
+}
+
+// Loads a nodeA,nodeB,speed CSV file into table, mapping it rather than
+// reading it.  See parseSpeeds.
+inline load_stats_t loadSpeedFile(const std::string &path, const EdgeLookup &lookup, SpeedTable &table,
+                                  const std::size_t num_threads, const std::size_t block_size = 16 * 1024 * 1024)
+{
+    const MappedFile file(path);
+    file.adviseSequential();
+    return parseSpeeds(file.data(), file.size(), lookup, num_threads, [&table](const std::vector<update_t> &updates) {
+        for (const auto &update : updates) table.set(update.edge, update.reversed, update.speed);
+    }, block_size);
+}
+
+} }
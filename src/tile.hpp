@@ -5,6 +5,12 @@
 
 #include <boost/geometry.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
 #include "web_mercator.hpp"
 #include "vector_tile.hpp"
 #include "common.hpp"
@@ -24,14 +30,55 @@ const static tile_box_t tile_clip_box(tile_point_t(-util::vector_tile::BUFFER, -
                                       tile_point_t(util::vector_tile::EXTENT + util::vector_tile::BUFFER,
                                                    util::vector_tile::EXTENT + util::vector_tile::BUFFER));
 
-struct tile_point_hash {
-    std::size_t operator()(const tile_point_t &key) const {
-        const auto a = std::hash<std::int32_t>()(key.get<0>());
-        const auto b = std::hash<std::int32_t>()(key.get<1>());
-        // From boost::hash_combine
-        return a ^ (b + 0x9e3779b9 + (a << 6) + (a >> 2));
+// Deepest zoom level we'll render tiles for
+const constexpr int MAX_ZOOM = 22;
+
+namespace detail {
+// Reads a run of up to 9 decimal digits starting at pos.  Fails on an empty
+// run or one that's too long to fit comfortably in an int.
+inline bool parseDecimal(const char *&pos, const char *end, int &value)
+{
+    const char *start = pos;
+    int result = 0;
+    while (pos != end && *pos >= '0' && *pos <= '9')
+    {
+        if (pos - start == 9) return false;
+        result = result * 10 + (*pos - '0');
+        ++pos;
     }
-};
+    if (pos == start) return false;
+    value = result;
+    return true;
+}
+
+inline bool consume(const char *&pos, const char *end, const char *literal)
+{
+    for (; *literal != '\0'; ++literal, ++pos)
+    {
+        if (pos == end || *pos != *literal) return false;
+    }
+    return true;
+}
+}
+
+// Parses a "/tile/{x}/{y}/{z}.mvt" request path in place, without allocating.
+// Returns false unless the path has exactly that shape and x/y are valid tile
+// numbers at zoom z.
+inline bool parseTilePath(const char *begin, const char *end, int &x, int &y, int &z)
+{
+    const char *pos = begin;
+    if (!detail::consume(pos, end, "/tile/") ||
+        !detail::parseDecimal(pos, end, x) || !detail::consume(pos, end, "/") ||
+        !detail::parseDecimal(pos, end, y) || !detail::consume(pos, end, "/") ||
+        !detail::parseDecimal(pos, end, z) || !detail::consume(pos, end, ".mvt") ||
+        pos != end)
+    {
+        return false;
+    }
+    if (z > MAX_ZOOM) return false;
+    const auto tiles = 1 << z;
+    return x < tiles && y < tiles;
+}
 
 struct tile_point_equal {
     bool operator()(const tile_point_t &a, const tile_point_t &b) const {
@@ -80,59 +127,248 @@ inline bool encodeLinestring(const tile_linestring_t  &line,
     return true;
 }
 
-inline tile_linestring_t segmentToTileLine(const wgs84_segment_t &segment,
-                                           const mercator_box_t &tile_bbox)
+/**
+ * Maps world coordinates onto the EXTENT x EXTENT grid of one tile.  A tile
+ * at zoom z is 2^(WORLD_BITS - z) world units wide, so once the tile origin
+ * is known, converting a point is a subtraction and a (rounding) shift.
+ **/
+struct TileTransform {
+    TileTransform(const int x, const int y, const int z)
+        : origin_x(static_cast<std::int64_t>(x) << (util::web_mercator::WORLD_BITS - z)),
+          origin_y(static_cast<std::int64_t>(y) << (util::web_mercator::WORLD_BITS - z)),
+          shift(static_cast<int>(util::web_mercator::WORLD_BITS) - z - EXTENT_BITS)
+    {
+    }
+
+    std::int32_t toTileX(const std::uint32_t world_x) const { return scale(world_x - origin_x); }
+    std::int32_t toTileY(const std::uint32_t world_y) const { return scale(world_y - origin_y); }
+
+    static const constexpr int EXTENT_BITS = 12;
+    static_assert((1 << EXTENT_BITS) == static_cast<int>(util::vector_tile::EXTENT), "EXTENT_BITS must match EXTENT");
+
+    std::int64_t origin_x;
+    std::int64_t origin_y;
+    int shift;
+
+  private:
+    std::int32_t scale(const std::int64_t offset) const
+    {
+        // Round to the nearest tile pixel.  Tiles deeper than z20 have more
+        // pixels than there are world units, so they scale up instead.
+        if (shift > 0) return static_cast<std::int32_t>((offset + (std::int64_t{1} << (shift - 1))) >> shift);
+        return static_cast<std::int32_t>(offset * (std::int64_t{1} << -shift));
+    }
+};
+
+// The world coordinate box covered by tile x/y/z
+inline world_box_t searchBox(const int x, const int y, const int z)
 {
-    wgs84_linestring_t geo_line;
-    geo_line.push_back(segment.first);
-    geo_line.push_back(segment.second);
+    const auto shift = util::web_mercator::WORLD_BITS - z;
+    const auto min_x = static_cast<std::uint64_t>(x) << shift;
+    const auto min_y = static_cast<std::uint64_t>(y) << shift;
+    return world_box_t({static_cast<std::uint32_t>(min_x), static_cast<std::uint32_t>(min_y)},
+                       {static_cast<std::uint32_t>(min_x + (std::uint64_t{1} << shift) - 1),
+                        static_cast<std::uint32_t>(min_y + (std::uint64_t{1} << shift) - 1)});
+}
 
-    mercator_linestring_t unclipped_line;
+namespace detail {
+// Liang-Barsky's test of one edge, narrowing [t1, t2] to the visible part
+inline bool clipEdge(const double p, const double q, double &t1, double &t2)
+{
+    if (p < 0)
+    {
+        const double r = q / p;
+        if (r > t2) return false;
+        if (r > t1) t1 = r;
+    }
+    else if (p > 0)
+    {
+        const double r = q / p;
+        if (r < t1) return false;
+        if (r < t2) t2 = r;
+    }
+    else if (q < 0)
+    {
+        return false;
+    }
+    return true;
+}
 
-    auto wgs84_to_tile = [&tile_bbox](const wgs84_point_t &wgs84_point) {
-        // Convert lon/lat to global mercator coordinates
-        double mercator_x = wgs84_point.get<0>() * util::web_mercator::DEGREE_TO_PX;
-        double mercator_y = util::web_mercator::latToY(wgs84_point.get<1>()) *
-                            util::web_mercator::DEGREE_TO_PX;
+// boost::geometry's test for duplicate points: equal to within an epsilon
+// relative to the larger coordinate
+inline bool nearlyEqual(const double a, const double b)
+{
+    if (a == b) return true;
+    const double scale = std::max(1., std::max(std::abs(a), std::abs(b)));
+    return std::abs(a - b) <= std::numeric_limits<double>::epsilon() * scale;
+}
 
-        // Convert global mercator coordinates to relative positions on
-        // the provide mercator tile
-        // convert lon/lat to tile coordinates
-        const auto box_width = tile_bbox.max_corner().get<0>() - tile_bbox.min_corner().get<0>();
-        const auto box_height = tile_bbox.max_corner().get<1>() - tile_bbox.min_corner().get<1>();
-        const auto tile_x = std::round(
-            ((mercator_x - tile_bbox.min_corner().get<0>()) * util::web_mercator::TILE_SIZE / box_width) *
-            util::vector_tile::EXTENT / util::web_mercator::TILE_SIZE);
-        const auto tile_y = std::round(
-            ((tile_bbox.max_corner().get<1>() - mercator_y) * util::web_mercator::TILE_SIZE / box_height) *
-            util::vector_tile::EXTENT / util::web_mercator::TILE_SIZE);
+inline int outcode(const std::int32_t x, const std::int32_t y, const std::int32_t min, const std::int32_t max)
+{
+    return (x < min) | ((x > max) << 1) | ((y < min) << 2) | ((y > max) << 3);
+}
+}
 
-        return mercator_point_t(tile_x, tile_y);
-    };
+/**
+ * Clips the segment start-end to tile_clip_box in place.  Returns false if
+ * nothing (or only a single point) of it is left.
+ *
+ * Segments entirely on the tile or entirely beyond one edge are decided from
+ * their outcodes.  The rest go through Liang-Barsky, doing the same double
+ * precision operations in the same order as boost::geometry::intersection
+ * did for us before, so the clipped points, truncated back to integers, come
+ * out identical to that.
+ **/
+inline bool clipSegment(tile_point_t &start, tile_point_t &end)
+{
+    const auto min = static_cast<std::int32_t>(-util::vector_tile::BUFFER);
+    const auto max = static_cast<std::int32_t>(util::vector_tile::EXTENT + util::vector_tile::BUFFER);
 
-    boost::geometry::append(unclipped_line, wgs84_to_tile(segment.first));
-    boost::geometry::append(unclipped_line, wgs84_to_tile(segment.second));
+    const auto x1 = start.get<0>();
+    const auto y1 = start.get<1>();
+    const auto x2 = end.get<0>();
+    const auto y2 = end.get<1>();
 
-    mercator_multi_linestring_t clipped_line;
+    const int code1 = detail::outcode(x1, y1, min, max);
+    const int code2 = detail::outcode(x2, y2, min, max);
+    if ((code1 & code2) != 0) return false;
+    if ((code1 | code2) == 0) return x1 != x2 || y1 != y2;
 
-    boost::geometry::intersection(tile_clip_box, unclipped_line, clipped_line);
+    const double dx = static_cast<double>(x2) - x1;
+    const double dy = static_cast<double>(y2) - y1;
+    double t1 = 0;
+    double t2 = 1;
+    if (!detail::clipEdge(-dx, static_cast<double>(x1) - min, t1, t2) ||
+        !detail::clipEdge(dx, static_cast<double>(max) - x1, t1, t2) ||
+        !detail::clipEdge(-dy, static_cast<double>(y1) - min, t1, t2) ||
+        !detail::clipEdge(dy, static_cast<double>(max) - y1, t1, t2))
+    {
+        return false;
+    }
 
-    tile_linestring_t tile_line;
+    double start_x = x1, start_y = y1, end_x = x2, end_y = y2;
+    if (t2 < 1)
+    {
+        end_x = x1 + t2 * dx;
+        end_y = y1 + t2 * dy;
+    }
+    if (t1 > 0)
+    {
+        start_x = x1 + t1 * dx;
+        start_y = y1 + t1 * dy;
+    }
+
+    if (detail::nearlyEqual(start_x, end_x) && detail::nearlyEqual(start_y, end_y)) return false;
+
+    start.set<0>(static_cast<std::int32_t>(start_x));
+    start.set<1>(static_cast<std::int32_t>(start_y));
+    end.set<0>(static_cast<std::int32_t>(end_x));
+    end.set<1>(static_cast<std::int32_t>(end_y));
+    return true;
+}
 
-    // b::g::intersection might return a line with one point if the
-    // original line was very short and coords were dupes
-    if (!clipped_line.empty() && clipped_line[0].size() == 2)
+namespace detail {
+// The clipping behind both clipChunks, with point(i) giving point i on the tile
+template <typename Point, typename Key, typename Emit>
+inline void clipRuns(const std::size_t num_points, Point point, tile_linestring_t &run, Key key, Emit emit)
+{
+    const tile_point_equal equal;
+    run.clear();
+    decltype(key(0)) run_key{};
+    tile_point_t previous = point(0);
+    for (std::size_t i = 1; i < num_points; ++i)
     {
-        if (clipped_line[0].size() == 2)
+        tile_point_t start = previous;
+        tile_point_t end = point(i);
+        previous = end;
+        if (equal(start, end)) continue;
+
+        // A run ends where a segment leaves the tile
+        if (!clipSegment(start, end))
+        {
+            if (!run.empty()) emit(run, run_key);
+            run.clear();
+            continue;
+        }
+
+        // or where the key changes
+        const auto segment_key = key(i - 1);
+        if (!run.empty() && (segment_key != run_key || !equal(run.back(), start)))
         {
-            for (const auto &p : clipped_line[0])
-            {
-                tile_line.emplace_back(p.get<0>(), p.get<1>());
-            }
+            emit(run, run_key);
+            run.clear();
         }
+
+        if (run.empty())
+        {
+            run.push_back(start);
+            run_key = segment_key;
+        }
+        run.push_back(end);
     }
+    if (!run.empty()) emit(run, run_key);
+}
+}
 
-    return tile_line;
+/**
+ * Projects a chunk's points onto the tile and clips each of its segments,
+ * calling emit(run, key) with every run of consecutive segments left on the
+ * tile that share the same key(i), where segment i runs from point i to
+ * point i + 1.  Segments that shrink to a single tile pixel are dropped
+ * without breaking the run.  run is used to hold the points.
+ **/
+template <typename Key, typename Emit>
+inline void clipChunk(const world_point_t *points,
+                      const std::size_t num_points,
+                      const TileTransform &transform,
+                      tile_linestring_t &run,
+                      Key key,
+                      Emit emit)
+{
+    detail::clipRuns(num_points,
+                     [points, &transform](const std::size_t i) {
+                         return tile_point_t(transform.toTileX(points[i].get<0>()), transform.toTileY(points[i].get<1>()));
+                     },
+                     run, key, emit);
+}
+
+// Projects points onto the pixel grid of transform's tile, which carries on
+// past its edges over the tiles around it
+inline void projectPoints(const world_point_t *points, const std::size_t num_points, const TileTransform &transform, std::vector<tile_point_t> &projected)
+{
+    projected.resize(num_points);
+    for (std::size_t i = 0; i < num_points; ++i)
+    {
+        projected[i] = tile_point_t(transform.toTileX(points[i].get<0>()), transform.toTileY(points[i].get<1>()));
+    }
+}
+
+/**
+ * Clips points already projected by projectPoints onto a neighbouring
+ * tile, dx tiles right of and dy tiles below the one they were projected
+ * for, like the clipChunk above.  Tile origins are whole multiples of the
+ * pixel size, so moving to the neighbour's grid is exact and the runs are
+ * the same as clipChunk gives for that tile, while a chunk drawn on several
+ * tiles is only projected once.
+ **/
+template <typename Key, typename Emit>
+inline void clipChunk(const tile_point_t *projected,
+                      const std::size_t num_points,
+                      const int dx,
+                      const int dy,
+                      tile_linestring_t &run,
+                      Key key,
+                      Emit emit)
+{
+    // Wrapping like TileTransform's own conversion does for far off points
+    const auto offset_x = static_cast<std::uint32_t>(dx) << TileTransform::EXTENT_BITS;
+    const auto offset_y = static_cast<std::uint32_t>(dy) << TileTransform::EXTENT_BITS;
+    detail::clipRuns(num_points,
+                     [projected, offset_x, offset_y](const std::size_t i) {
+                         return tile_point_t(static_cast<std::int32_t>(static_cast<std::uint32_t>(projected[i].get<0>()) - offset_x),
+                                             static_cast<std::int32_t>(static_cast<std::uint32_t>(projected[i].get<1>()) - offset_y));
+                     },
+                     run, key, emit);
 }
 
 } }
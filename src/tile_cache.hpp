@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A memory bounded cache of encoded tiles, keyed by z/x/y.
+ *
+ * Tiles are spread over independently locked shards, each an LRU list with
+ * its share of the byte budget, so render threads inserting and HTTP threads
+ * looking up rarely wait for each other.  Cached tiles are the same shared
+ * buffers responses send from, so a hit costs a lookup and a reference count.
+ *
+ * Every tile carries the data generation it was rendered from, so a slow
+ * render can't replace a newer tile.  Tiles whose data has changed are
+ * dropped one by one.
+ **/
+class TileCache {
+  public:
+    typedef std::shared_ptr<const std::string> tile_t;
+
+    struct stats_t {
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        // Tiles dropped because their data changed
+        std::uint64_t invalidations = 0;
+    };
+
+    TileCache(const std::size_t max_bytes, const std::size_t num_shards = 16)
+        : shards(num_shards == 0 ? 1 : num_shards), shard_bytes(max_bytes / shards.size())
+    {
+    }
+
+    TileCache(const TileCache &) = delete;
+    TileCache &operator=(const TileCache &) = delete;
+
+    // The cached tile, or nullptr if it isn't cached
+    tile_t find(const int x, const int y, const int z)
+    {
+        const auto key = makeKey(x, y, z);
+        auto &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const auto found = shard.index.find(key);
+        if (found == shard.index.end())
+        {
+            ++shard.misses;
+            return nullptr;
+        }
+
+        ++shard.hits;
+        // Most recently used at the front
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return found->second->tile;
+    }
+
+    // Caches a tile rendered from data generation `generation`, replacing
+    // anything cached for it before, and evicts the least recently used
+    // tiles of its shard until the shard is back within budget.
+    void insert(const int x, const int y, const int z, const std::uint64_t generation, tile_t tile)
+    {
+        const auto key = makeKey(x, y, z);
+        auto &shard = shardOf(key);
+        const auto size = entrySize(*tile);
+        if (size > shard_bytes) return;
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto found = shard.index.find(key);
+        if (found != shard.index.end())
+        {
+            // Don't let a slow render overwrite a newer tile
+            if (found->second->generation > generation) return;
+            shard.erase(found->second);
+        }
+
+        shard.lru.push_front({key, generation, std::move(tile)});
+        shard.index.emplace(key, shard.lru.begin());
+        shard.bytes += size;
+        while (shard.bytes > shard_bytes)
+        {
+            shard.erase(std::prev(shard.lru.end()));
+            ++shard.evictions;
+        }
+    }
+
+    // Drops the tile if it's cached, for when just its data has changed.
+    // The caller must make sure no render from before the change can still
+    // insert it.
+    void erase(const int x, const int y, const int z)
+    {
+        const auto key = makeKey(x, y, z);
+        auto &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto found = shard.index.find(key);
+        if (found == shard.index.end()) return;
+        shard.erase(found->second);
+        ++shard.invalidations;
+    }
+
+    stats_t stats()
+    {
+        stats_t result;
+        result.capacity = shard_bytes * shards.size();
+        for (auto &shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.entries += shard.index.size();
+            result.bytes += shard.bytes;
+            result.hits += shard.hits;
+            result.misses += shard.misses;
+            result.evictions += shard.evictions;
+            result.invalidations += shard.invalidations;
+        }
+        return result;
+    }
+
+  private:
+    struct entry_t {
+        std::uint64_t key;
+        std::uint64_t generation;
+        tile_t tile;
+    };
+
+    struct shard_t {
+        std::mutex mutex;
+        std::list<entry_t> lru;
+        std::unordered_map<std::uint64_t, std::list<entry_t>::iterator> index;
+        std::size_t bytes = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t invalidations = 0;
+
+        void erase(const std::list<entry_t>::iterator entry)
+        {
+            bytes -= entrySize(*entry->tile);
+            index.erase(entry->key);
+            lru.erase(entry);
+        }
+    };
+
+    // The tile plus a rough allowance for the list node, index entry and
+    // string header, so lots of tiny tiles can't blow the budget
+    static std::size_t entrySize(const std::string &tile) { return tile.size() + 128; }
+
+    // Room for x and y up to 2^29 each, far beyond MAX_ZOOM
+    static std::uint64_t makeKey(const int x, const int y, const int z)
+    {
+        return (static_cast<std::uint64_t>(z) << 58) | (static_cast<std::uint64_t>(x) << 29) | static_cast<std::uint64_t>(y);
+    }
+
+    shard_t &shardOf(const std::uint64_t key)
+    {
+        // Neighbouring tiles go to different shards
+        return shards[((key * 0x9E3779B97F4A7C15ull) >> 32) % shards.size()];
+    }
+
+    std::vector<shard_t> shards;
+    const std::size_t shard_bytes;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace util { namespace detail {
+
+// Seven bits at a time, lowest first, with the top bit set on all but the last byte
+inline void writeVarint(std::vector<std::uint8_t> &bytes, std::uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        bytes.push_back(static_cast<std::uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<std::uint8_t>(value));
+}
+
+inline std::uint64_t readVarint(const std::uint8_t *&p)
+{
+    std::uint64_t value = *p & 0x7f;
+    for (int shift = 7; *p++ & 0x80; shift += 7) value |= static_cast<std::uint64_t>(*p & 0x7f) << shift;
+    return value;
+}
+
+// Interleaves negative and positive values, so small ones of either sign
+// make small varints
+inline std::uint64_t zigzag(const std::int64_t value)
+{
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+inline std::int64_t unzigzag(const std::uint64_t value)
+{
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+} }
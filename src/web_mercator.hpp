@@ -3,6 +3,11 @@
 
 #include <boost/math/constants/constants.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
 namespace util
 {
 namespace web_mercator
@@ -24,6 +29,10 @@ const constexpr double MAX_LONGITUDE = 180.0;
 const constexpr double DEGREE_TO_PX = detail::MAXEXTENT / 180.0;
 // This is the global default tile size for all Mapbox Vector Tiles
 const constexpr double TILE_SIZE = 256.0;
+// World coordinates are web mercator positions stored as fixed point integers
+// on a 2^WORLD_BITS square grid covering the whole world, with y growing south
+// like tile numbers do.  At 32 bits a grid cell is a pixel of a z20 tile.
+const constexpr unsigned WORLD_BITS = 32;
 
 typedef double FloatLatitude;
 typedef double FloatLongitude;
@@ -46,48 +55,48 @@ inline double latToY(const FloatLatitude latitude)
     return clamped_y;
 }
 
-template <typename T> constexpr double horner(double, T an) { return an; }
-
-template <typename T, typename... U> constexpr double horner(double x, T an, U... a)
+namespace detail
 {
-    return horner(x, a...) * x + an;
+// Padé approximant [11/11] of the inverse Gudermannian function: deg → deg
+// Coefficients are computed for the argument range [-70°,70°] by Remez algorithm
+// |err|_∞=3.387e-12
+const constexpr double LAT_TO_Y_APPROX_LIMIT = 70.;
+const constexpr std::size_t LAT_TO_Y_APPROX_TERMS = 12;
+const constexpr double LAT_TO_Y_NUMERATOR[LAT_TO_Y_APPROX_TERMS] = {
+    0.00000000000000000000000000e+00,  1.00000000000089108431373566e+00,
+    2.34439410386997223035693483e-06,  -3.21291701673364717170998957e-04,
+    -6.62778508496089940141103135e-10, 3.68188055470304769936079078e-08,
+    6.31192702320492485752941578e-14,  -1.77274453235716299127325443e-12,
+    -2.24563810831776747318521450e-18, 3.13524754818073129982475171e-17,
+    2.09014225025314211415458228e-23,  -9.82938075991732185095509716e-23};
+const constexpr double LAT_TO_Y_DENOMINATOR[LAT_TO_Y_APPROX_TERMS] = {
+    1.00000000000000000000000000e+00,  2.34439410398970701719081061e-06,
+    -3.72061271627251952928813333e-04, -7.81802389685429267252612620e-10,
+    5.18418724186576447072888605e-08,  9.37468561198098681003717477e-14,
+    -3.30833288607921773936702558e-12, -4.78446279888774903983338274e-18,
+    9.32999229169156878168234191e-17,  9.17695141954265959600965170e-23,
+    -8.72130728982012387640166055e-22, -3.23083224835967391884404730e-28};
+
+// Evaluates the polynomial with the given coefficients, lowest order first
+inline double horner(const double x, const double (&coefficients)[LAT_TO_Y_APPROX_TERMS])
+{
+    double result = coefficients[LAT_TO_Y_APPROX_TERMS - 1];
+    for (std::size_t i = LAT_TO_Y_APPROX_TERMS - 1; i > 0; --i)
+    {
+        result = result * x + coefficients[i - 1];
+    }
+    return result;
+}
 }
 
 inline double latToYapprox(const FloatLatitude latitude)
 {
-    if (latitude < FloatLatitude{-70.} || latitude > FloatLatitude{70.})
+    if (latitude < FloatLatitude{-detail::LAT_TO_Y_APPROX_LIMIT} ||
+        latitude > FloatLatitude{detail::LAT_TO_Y_APPROX_LIMIT})
         return latToY(latitude);
 
-    // Approximate the inverse Gudermannian function with the Padé approximant [11/11]: deg → deg
-    // Coefficients are computed for the argument range [-70°,70°] by Remez algorithm
-    // |err|_∞=3.387e-12
     const auto x = static_cast<double>(latitude);
-    return horner(x,
-                  0.00000000000000000000000000e+00,
-                  1.00000000000089108431373566e+00,
-                  2.34439410386997223035693483e-06,
-                  -3.21291701673364717170998957e-04,
-                  -6.62778508496089940141103135e-10,
-                  3.68188055470304769936079078e-08,
-                  6.31192702320492485752941578e-14,
-                  -1.77274453235716299127325443e-12,
-                  -2.24563810831776747318521450e-18,
-                  3.13524754818073129982475171e-17,
-                  2.09014225025314211415458228e-23,
-                  -9.82938075991732185095509716e-23) /
-           horner(x,
-                  1.00000000000000000000000000e+00,
-                  2.34439410398970701719081061e-06,
-                  -3.72061271627251952928813333e-04,
-                  -7.81802389685429267252612620e-10,
-                  5.18418724186576447072888605e-08,
-                  9.37468561198098681003717477e-14,
-                  -3.30833288607921773936702558e-12,
-                  -4.78446279888774903983338274e-18,
-                  9.32999229169156878168234191e-17,
-                  9.17695141954265959600965170e-23,
-                  -8.72130728982012387640166055e-22,
-                  -3.23083224835967391884404730e-28);
+    return detail::horner(x, detail::LAT_TO_Y_NUMERATOR) / detail::horner(x, detail::LAT_TO_Y_DENOMINATOR);
 }
 
 inline FloatLatitude clampLat(const FloatLatitude lat)
@@ -128,6 +137,27 @@ inline double latToPixel(FloatLatitude lat, unsigned zoom)
     return y;
 }
 
+namespace detail
+{
+// Scales a [0,1] fraction of the world onto the integer world grid
+inline std::uint32_t fractionToWorld(const double fraction)
+{
+    const double max = static_cast<double>((std::uint64_t{1} << WORLD_BITS) - 1);
+    const double scaled = std::round(fraction * static_cast<double>(std::uint64_t{1} << WORLD_BITS));
+    return static_cast<std::uint32_t>(std::max(0., std::min(max, scaled)));
+}
+}
+
+inline std::uint32_t lonToWorldX(const FloatLongitude lon)
+{
+    return detail::fractionToWorld(0.5 + static_cast<double>(lon) / 360.);
+}
+
+inline std::uint32_t latToWorldY(const FloatLatitude lat)
+{
+    return detail::fractionToWorld(0.5 - latToY(lat) / 360.);
+}
+
 /*
 inline FloatCoordinate fromWGS84(const FloatCoordinate &wgs84_coordinate)
 {
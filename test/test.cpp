@@ -1,94 +1,1005 @@
 #include "common.hpp"
 #include "merge.hpp"
+#include "tile.hpp"
+#include "packed_index.hpp"
+#include "projection.hpp"
+#include "simplify.hpp"
+#include "tile_cache.hpp"
+#include "pending_blocks.hpp"
+#include "dirty_tiles.hpp"
+#include "edge_lookup.hpp"
+#include "speeds.hpp"
+#include "speed_store.hpp"
+#include "speed_bins.hpp"
+#include "snapshot.hpp"
+#include "parallel.hpp"
+#include "node_locations.hpp"
+#include "road_classes.hpp"
+#include "config.hpp"
 
-void dump(const tile_line_vector &lines, const coordinate_line_map &starts, const coordinate_line_map &ends) {
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include <unistd.h>
+
+std::vector<std::string> mergedLines(const LineMerger &merger) {
+    std::vector<std::string> result;
+    util::tile::tile_linestring_t line;
+    merger.forEachLine(line, [&result](const util::tile::tile_linestring_t &line) {
+        std::string points;
+        for (const auto &pt : line) {
+            points += std::to_string(pt.get<0>()) + "," + std::to_string(pt.get<1>()) + " ";
+        }
+        result.push_back(points);
+    });
+    return result;
+}
+
+void dump(const LineMerger &merger) {
     std::clog << "----------" << std::endl;
-    for (const auto & startlist : starts) {
-        std::clog << "  Lines starting at  " << startlist.first.get<0>() << "," << startlist.first.get<1>() << std::endl;
-        for (const auto & start : startlist.second) {
-            const auto &line = lines[start];
+    for (const auto &line : mergedLines(merger)) {
+        std::clog << "    Line: " << line << std::endl;
+    }
+}
+
+void addsegment(LineMerger &merger, int x1, int y1, int x2, int y2) {
+    std::clog << "Adding segment " << x1 << "," << y1 << " - " << x2 << "," << y2 << std::endl;
+    util::tile::tile_linestring_t line;
+    line.emplace_back(x1, y1);
+    line.emplace_back(x2, y2);
+    merger.add(line);
+}
+
+// n single segment chunks with random boxes and minzooms, drawn from rng,
+// for testing the indexes
+std::vector<chunk_t> randomChunks(std::mt19937 &rng, const std::size_t n) {
+    std::vector<chunk_t> chunks;
+    chunks.reserve(n);
+    for (edge_id_t i = 0; i < n; ++i) {
+        chunk_t chunk;
+        chunk.min_x = rng() % 0xFFF00000u;
+        chunk.min_y = rng() % 0xFFF00000u;
+        chunk.max_x = chunk.min_x + rng() % 1000000;
+        chunk.max_y = chunk.min_y + rng() % 1000000;
+        chunk.first_point = i * 2;
+        chunk.first_edge = i;
+        chunk.num_points = 2;
+        chunk.minzoom = static_cast<std::uint8_t>(4 + rng() % 13);
+        chunks.push_back(chunk);
+    }
+    return chunks;
+}
+
+void test1() {
+    LineMerger merger;
+
+    addsegment(merger, 1,1,2,2);
+    addsegment(merger, 2,2,3,3);
+    addsegment(merger, 3,3,4,4);
+    addsegment(merger, 7,7,4,4);
+    addsegment(merger, 5,5,6,6);
+    addsegment(merger, 0,0,1,1);
+    addsegment(merger, 4,4,5,5);
+    addsegment(merger, 4,4,5,5);
+    dump(merger);
+
+    // Two lines end at 4,4, the most recent one is joined to 5,5 - 6,6 and
+    // the repeated 4,4 - 5,5 then extends the other
+    const std::vector<std::string> expected{"0,0 1,1 2,2 3,3 4,4 5,5 ", "7,7 4,4 5,5 6,6 "};
+    assert(mergedLines(merger) == expected);
+}
+
+void test2() {
+    LineMerger merger;
+
+    addsegment(merger, 1,0,2,0);
+    addsegment(merger, 2,0,3,0);
+    addsegment(merger, 3,1,2,1);
+    addsegment(merger, 2,1,1,1);
+    addsegment(merger, 1,1,1,0);
+    addsegment(merger, 3,0,3,1);
+    dump(merger);
+
+    // Everything joins up into a single closed line
+    const std::vector<std::string> expected{"3,1 2,1 1,1 1,0 2,0 3,0 3,1 "};
+    assert(mergedLines(merger) == expected);
+
+    // and a cleared merger starts again from nothing
+    merger.clear();
+    assert(merger.numLines() == 0);
+    addsegment(merger, 3,0,3,1);
+    assert(mergedLines(merger) == std::vector<std::string>{"3,0 3,1 "});
+}
+
+void testMergeChain() {
+    // A long road arriving back to front is all prepends, and one arriving
+    // in alternate pieces needs a join for every other segment
+    const int length = 200000;
+    LineMerger merger;
+    util::tile::tile_linestring_t line;
+    const auto add = [&merger, &line](int x1, int y1, int x2, int y2) {
+        line.clear();
+        line.emplace_back(x1, y1);
+        line.emplace_back(x2, y2);
+        merger.add(line);
+    };
+    for (int i = length; i > 0; --i) add(i - 1, 0, i, 0);
+    for (int i = 0; i < length; i += 2) add(i, 1, i + 1, 1);
+    for (int i = 1; i < length; i += 2) add(i, 1, i + 1, 1);
+    assert(merger.numLines() == 2);
+
+    int y = 0;
+    merger.forEachLine(line, [&y, length](const util::tile::tile_linestring_t &line) {
+        assert(line.size() == static_cast<std::size_t>(length) + 1);
+        for (int i = 0; i <= length; ++i) assert(line[i].get<0>() == i && line[i].get<1>() == y);
+        ++y;
+    });
+}
+
+bool parsetile(const char *path, int &x, int &y, int &z) {
+    return util::tile::parseTilePath(path, path + std::strlen(path), x, y, z);
+}
+
+void testTilePath() {
+    int x, y, z;
+    assert(parsetile("/tile/657/1582/12.mvt", x, y, z));
+    assert(x == 657 && y == 1582 && z == 12);
+    assert(parsetile("/tile/0/0/0.mvt", x, y, z));
+    assert(x == 0 && y == 0 && z == 0);
+
+    // x/y out of range for the zoom level
+    assert(!parsetile("/tile/2/0/1.mvt", x, y, z));
+    assert(!parsetile("/tile/0/4096/12.mvt", x, y, z));
+    // zoom too deep, or numbers too long to be real
+    assert(!parsetile("/tile/0/0/23.mvt", x, y, z));
+    assert(!parsetile("/tile/0/0/1234567890.mvt", x, y, z));
+    // anything that isn't exactly the tile route
+    assert(!parsetile("/tile/1/1/1.mvt?x=1", x, y, z));
+    assert(!parsetile("/tile/1/1/1.png", x, y, z));
+    assert(!parsetile("/tile/1//1.mvt", x, y, z));
+    assert(!parsetile("/tile/-1/1/1.mvt", x, y, z));
+    assert(!parsetile("/tiles/1/1/1.mvt", x, y, z));
+    assert(!parsetile("/tile/1/1", x, y, z));
+    assert(!parsetile("", x, y, z));
+}
+
+// The per-request projection that world coordinates replaced
+double oldTileCoordinate(double lon, double lat, int x, int y, int z, bool want_y) {
+    double min_x, min_y, max_x, max_y;
+    util::web_mercator::xyzToMercator(x, y, z, min_x, min_y, max_x, max_y);
+    if (!want_y) {
+        const double mercator_x = lon * util::web_mercator::DEGREE_TO_PX;
+        return (mercator_x - min_x) / (max_x - min_x) * util::vector_tile::EXTENT;
+    }
+    const double mercator_y = util::web_mercator::latToY(lat) * util::web_mercator::DEGREE_TO_PX;
+    return (max_y - mercator_y) / (max_y - min_y) * util::vector_tile::EXTENT;
+}
+
+void testTileTransform() {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> lons(-179.9, 179.9);
+    std::uniform_real_distribution<double> lats(-84.9, 84.9);
+    for (int i = 0; i < 10000; ++i) {
+        const double lon = lons(rng);
+        const double lat = lats(rng);
+        for (int z = 2; z <= 20; z += 2) {
+            const int x = static_cast<int>(util::web_mercator::lonToPixel(lon, z) / util::web_mercator::TILE_SIZE);
+            const int y = static_cast<int>(util::web_mercator::latToPixel(lat, z) / util::web_mercator::TILE_SIZE);
+            // The old path clamped the tile box to 85 degrees, which
+            // stretched the top and bottom rows of tiles
+            if (y == 0 || y == (1 << z) - 1) continue;
+            const util::tile::TileTransform transform(x, y, z);
+            const auto tile_x = transform.toTileX(util::web_mercator::lonToWorldX(lon));
+            const auto tile_y = transform.toTileY(util::web_mercator::latToWorldY(lat));
+            // Within a pixel of the floating point result
+            assert(std::abs(tile_x - oldTileCoordinate(lon, lat, x, y, z, false)) <= 1.0);
+            assert(std::abs(tile_y - oldTileCoordinate(lon, lat, x, y, z, true)) <= 1.0);
+        }
+    }
+
+    // The whole world at z0 spans exactly one extent
+    const util::tile::TileTransform world(0, 0, 0);
+    assert(world.toTileX(0) == 0);
+    assert(world.toTileX(0xFFFFFFFF) == util::vector_tile::EXTENT);
+    assert(world.toTileY(1u << 31) == util::vector_tile::EXTENT / 2);
+}
+
+void testHilbert() {
+    // The first 256 positions on the curve fill the 16x16 block at the
+    // origin, and each step moves to a neighbouring cell
+    std::vector<std::pair<int, int>> cells(256, {-1, -1});
+    for (std::uint32_t x = 0; x < 16; ++x) {
+        for (std::uint32_t y = 0; y < 16; ++y) {
+            const auto d = util::detail::hilbertIndex(x, y);
+            assert(d < 256);
+            assert(cells[d].first == -1);
+            cells[d] = {x, y};
+        }
+    }
+    for (std::size_t d = 1; d < cells.size(); ++d) {
+        assert(std::abs(cells[d].first - cells[d - 1].first) + std::abs(cells[d].second - cells[d - 1].second) == 1);
+    }
+}
+
+void testPackedIndex() {
+    std::mt19937 rng(7);
+    auto segments = randomChunks(rng, 5000);
 
-            std::clog << "    Line: " << start << ": ";
+    util::ZoomIndex index;
+    index.build(segments, chunk_minzoom(), chunk_indexable());
+    assert(index.size() == segments.size());
+    for (std::size_t i = 1; i < segments.size(); ++i) {
+        assert(segments[i - 1].minzoom <= segments[i].minzoom);
+    }
+
+    const chunk_indexable indexable;
+    std::vector<util::PackedIndex::range_t> ranges;
+    std::vector<std::uint32_t> stack;
+    for (int q = 0; q < 200; ++q) {
+        const int z = 4 + q % 13;
+        const int x = rng() % (1 << z);
+        const int y = rng() % (1 << z);
+        const auto box = util::tile::searchBox(x, y, z);
+
+        ranges.clear();
+        index.query(box, z, ranges, stack);
 
-            for (const auto &pt : line) {
-                std::clog << pt.get<0>() << "," << pt.get<1>() << " ";
+        std::vector<bool> found(segments.size(), false);
+        std::uint32_t last = 0;
+        for (const auto &range : ranges) {
+            // Ordered and not overlapping
+            assert(range.first < range.second);
+            assert(range.first >= last);
+            last = range.second;
+            for (auto i = range.first; i < range.second; ++i) {
+                // Never anything from a band that isn't visible yet
+                assert(segments[i].minzoom <= z);
+                found[i] = true;
             }
-            std::clog << std::endl;
         }
+        for (std::size_t i = 0; i < segments.size(); ++i) {
+            if (segments[i].minzoom <= z && boost::geometry::intersects(indexable(segments[i]), box)) assert(found[i]);
+        }
+    }
+}
+
+// What clipping a segment used to do: clip with boost::geometry in doubles,
+// keeping the result only if it's still a two point line
+bool boostClip(util::tile::tile_point_t &start, util::tile::tile_point_t &end) {
+    util::tile::mercator_linestring_t unclipped_line;
+    boost::geometry::append(unclipped_line, util::tile::mercator_point_t(start.get<0>(), start.get<1>()));
+    boost::geometry::append(unclipped_line, util::tile::mercator_point_t(end.get<0>(), end.get<1>()));
+
+    util::tile::mercator_multi_linestring_t clipped_line;
+    boost::geometry::intersection(util::tile::tile_clip_box, unclipped_line, clipped_line);
+    if (clipped_line.empty() || clipped_line[0].size() != 2) return false;
+
+    const auto &first = clipped_line[0][0];
+    const auto &second = clipped_line[0][1];
+    start = util::tile::tile_point_t(static_cast<std::int32_t>(first.get<0>()), static_cast<std::int32_t>(first.get<1>()));
+    end = util::tile::tile_point_t(static_cast<std::int32_t>(second.get<0>()), static_cast<std::int32_t>(second.get<1>()));
+    return true;
+}
+
+void checkClip(int x1, int y1, int x2, int y2) {
+    util::tile::tile_point_t start(x1, y1), end(x2, y2);
+    util::tile::tile_point_t expected_start(x1, y1), expected_end(x2, y2);
+    const bool clipped = util::tile::clipSegment(start, end);
+    const bool expected = boostClip(expected_start, expected_end);
+    if (clipped != expected ||
+        (expected && !(util::tile::tile_point_equal()(start, expected_start) && util::tile::tile_point_equal()(end, expected_end)))) {
+        std::clog << "Clipping " << x1 << "," << y1 << " - " << x2 << "," << y2 << " differs from boost" << std::endl;
+        assert(false);
+    }
+}
+
+void testClipSegment() {
+    const int min = -util::vector_tile::BUFFER;
+    const int max = util::vector_tile::EXTENT + util::vector_tile::BUFFER;
+
+    // Every pairing of points on a coarse grid around and across the clip box,
+    // which covers the corners, lines along the edges and zero length segments
+    std::vector<int> coords;
+    for (const int base : {min, 0, 2048, 4096, max}) {
+        for (const int delta : {-3000, -1, 0, 1, 3000}) coords.push_back(base + delta);
+    }
+    for (const int x1 : coords) for (const int y1 : coords) {
+        for (const int x2 : coords) for (const int y2 : coords) {
+            checkClip(x1, y1, x2, y2);
+        }
+    }
+
+    // Random segments, long ones and short ones crossing the box edges
+    std::mt19937 rng(9);
+    std::uniform_int_distribution<int> anywhere(-10000, 14000);
+    std::uniform_int_distribution<int> edge(-200, 200);
+    std::uniform_int_distribution<int> nearby(-20, 20);
+    for (int i = 0; i < 200000; ++i) {
+        checkClip(anywhere(rng), anywhere(rng), anywhere(rng), anywhere(rng));
+
+        const int x = (i & 1 ? min : max) + edge(rng);
+        const int y = (i & 2 ? min : max) + edge(rng);
+        checkClip(x, y, x + nearby(rng), y + nearby(rng));
+    }
+}
+
+void checkProjection(util::web_mercator::detail::project_kernel_t kernel,
+                     const std::vector<double> &lons, const std::vector<double> &lats,
+                     const std::vector<std::uint32_t> &expected_xs, const std::vector<std::uint32_t> &expected_ys) {
+    std::vector<std::uint32_t> xs(lons.size()), ys(lats.size());
+    kernel(lons.data(), lats.data(), lons.size(), xs.data(), ys.data());
+    assert(xs == expected_xs);
+    assert(ys == expected_ys);
+}
+
+void testProjection() {
+    using namespace util::web_mercator;
+
+    // An odd count so the vector kernels have a tail to finish
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> lon_dist(-180., 180.);
+    std::uniform_real_distribution<double> lat_dist(-86., 86.);
+    std::vector<double> lons, lats;
+    for (const double lat : {-90., -85.0511, -70.0000001, -70., 0., 70., 70.0000001, 85.0511, 90.}) {
+        lons.push_back(lats.size() % 2 ? -180. : 180.);
+        lats.push_back(lat);
+    }
+    for (int i = 0; i < 100001; ++i) {
+        lons.push_back(lon_dist(rng));
+        lats.push_back(lat_dist(rng));
     }
 
-    for (const auto & endlist : ends) {
-        std::clog << "  Lines ending at  " << endlist.first.get<0>() << "," << endlist.first.get<1>() << std::endl;
-        for (const auto & end : endlist.second) {
-            const auto &line = lines[end];
+    // The approximant is good to within one world unit, a pixel of a z20
+    // tile, of the exact projection
+    std::vector<std::uint32_t> xs(lons.size()), ys(lats.size());
+    projectToWorld(lons.data(), lats.data(), lons.size(), xs.data(), ys.data());
+    for (std::size_t i = 0; i < lons.size(); ++i) {
+        assert(std::abs(static_cast<std::int64_t>(xs[i]) - lonToWorldX(lons[i])) <= 1);
+        assert(std::abs(static_cast<std::int64_t>(ys[i]) - latToWorldY(lats[i])) <= 1);
+    }
+
+    // and every kernel the CPU supports gives the reference kernel's results exactly
+    std::vector<std::uint32_t> expected_xs(lons.size()), expected_ys(lats.size());
+    detail::projectScalar(lons.data(), lats.data(), lons.size(), expected_xs.data(), expected_ys.data());
+    assert(xs == expected_xs && ys == expected_ys);
+#ifdef UTIL_PROJECTION_X86
+    if (__builtin_cpu_supports("avx2")) checkProjection(detail::projectAVX2, lons, lats, expected_xs, expected_ys);
+    if (__builtin_cpu_supports("sse4.1")) checkProjection(detail::projectSSE4, lons, lats, expected_xs, expected_ys);
+#endif
+}
+
+void testClipChunk() {
+    // A z20 tile is exactly one world unit per tile pixel, offset by the tile origin
+    const int x = 1000, y = 2000, z = 20;
+    const util::tile::TileTransform transform(x, y, z);
+    const std::uint32_t origin_x = x << 12, origin_y = y << 12;
+    const auto point = [&](int px, int py) { return world_point_t(origin_x + px, origin_y + py); };
+
+    // In, out past the right hand edge and back in again, with a segment
+    // that doesn't move in the middle of the first run
+    const std::vector<world_point_t> points{point(0, 0), point(100, 0), point(100, 0), point(100, 100),
+                                            point(5000, 100), point(5000, 200), point(200, 200), point(200, 300)};
+    std::vector<std::string> runs;
+    util::tile::tile_linestring_t run;
+    const auto clip = [&](std::function<int(std::size_t)> key) {
+        runs.clear();
+        util::tile::clipChunk(points.data(), points.size(), transform, run, key, [&runs](const util::tile::tile_linestring_t &run, const int key) {
+            std::string text = std::to_string(key) + ": ";
+            for (const auto &pt : run) text += std::to_string(pt.get<0>()) + "," + std::to_string(pt.get<1>()) + " ";
+            runs.push_back(text);
+        });
+    };
+    clip([](std::size_t) { return 0; });
+    const std::vector<std::string> expected{"0: 0,0 100,0 100,100 4224,100 ", "0: 4224,200 200,200 200,300 "};
+    assert(runs == expected);
 
-            std::clog << "    Line: " << end << ": ";
+    // Runs also end where the key changes
+    clip([](std::size_t segment) { return segment < 3 ? 1 : 2; });
+    const std::vector<std::string> keyed{"1: 0,0 100,0 100,100 ", "2: 100,100 4224,100 ", "2: 4224,200 200,200 200,300 "};
+    assert(runs == keyed);
 
-            for (const auto &pt : line) {
-                std::clog << pt.get<0>() << "," << pt.get<1>() << " ";
+    // Clipping points projected for one tile onto its neighbours gives the
+    // same runs as projecting them for each neighbour, at any zoom
+    std::mt19937 rng(5);
+    for (const int zoom : {3, 12, 20, 22}) {
+        const int left = (1 << zoom) / 2 - 2, top = (1 << zoom) / 3;
+        const auto shift = util::web_mercator::WORLD_BITS - static_cast<unsigned>(zoom);
+        std::vector<world_point_t> line;
+        for (int i = 0; i < 40; ++i) {
+            // Wandering over the 4x4 block and a tile beyond it
+            const auto spread = std::uint64_t{6} << shift;
+            line.emplace_back(static_cast<std::uint32_t>((std::uint64_t(left - 1) << shift) + rng() % spread),
+                              static_cast<std::uint32_t>((std::uint64_t(top - 1) << shift) + rng() % spread));
+        }
+        std::vector<util::tile::tile_point_t> projected;
+        util::tile::projectPoints(line.data(), line.size(), util::tile::TileTransform(left, top, zoom), projected);
+        for (int dy = 0; dy < 4; ++dy) {
+            for (int dx = 0; dx < 4; ++dx) {
+                std::vector<std::string> direct, shifted;
+                const auto record = [](std::vector<std::string> &out) {
+                    return [&out](const util::tile::tile_linestring_t &run, const int key) {
+                        std::string text = std::to_string(key) + ": ";
+                        for (const auto &pt : run) text += std::to_string(pt.get<0>()) + "," + std::to_string(pt.get<1>()) + " ";
+                        out.push_back(text);
+                    };
+                };
+                const auto key = [](std::size_t segment) { return static_cast<int>(segment / 7); };
+                util::tile::clipChunk(line.data(), line.size(), util::tile::TileTransform(left + dx, top + dy, zoom), run, key, record(direct));
+                util::tile::clipChunk(projected.data(), projected.size(), dx, dy, run, key, record(shifted));
+                assert(direct == shifted);
             }
-            std::clog << std::endl;
         }
     }
 }
 
-util::tile::tile_linestring_t makesegment(int x1, int y1, int x2, int y2) {
-    std::clog << "Making segment " << x1 << "," << y1 << " - " << x2 << "," << y2 << std::endl;
-    util::tile::tile_linestring_t segment;
-    segment.emplace_back(x1,y1);
-    segment.emplace_back(x2,y2);
-    return segment;
+void testSimplify() {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack;
+    std::vector<std::uint8_t> keep;
+
+    // Repeats go, whatever else happens
+    util::tile::tile_linestring_t line;
+    for (const auto &pt : std::vector<std::pair<int, int>>{{0, 0}, {0, 0}, {10, 0}, {10, 0}, {10, 0}, {20, 5}}) line.emplace_back(pt.first, pt.second);
+    util::tile::removeRepeatedPoints(line);
+    assert(line.size() == 3);
+
+    // A wiggle within tolerance of a straight line is flattened, a bigger one
+    // is kept, and both ends always stay
+    line.clear();
+    for (int i = 0; i <= 100; ++i) line.emplace_back(i * 10, i % 2 ? 3 : 0);
+    line.emplace_back(1010, 200);
+    line.emplace_back(1020, 0);
+    util::tile::simplifyLine(line, 4, stack, keep);
+    assert(line.size() == 4);
+    assert(line[0].get<0>() == 0 && line[1].get<0>() == 1000 && line[2].get<0>() == 1010 && line[3].get<0>() == 1020);
+
+    // Every dropped point is within tolerance of the simplified line
+    std::mt19937 rng(5);
+    std::uniform_int_distribution<int> step(-20, 20);
+    for (const double tolerance : {1., 4., 16.}) {
+        util::tile::tile_linestring_t original;
+        int x = 0, y = 0;
+        for (int i = 0; i < 1000; ++i) {
+            original.emplace_back(x, y);
+            x += 6 + step(rng) / 4;
+            y += step(rng);
+        }
+        line = original;
+        util::tile::simplifyLine(line, tolerance, stack, keep);
+        assert(line.size() < original.size());
+        std::size_t segment = 0;
+        for (const auto &pt : original) {
+            while (line[segment + 1].get<0>() < pt.get<0>()) ++segment;
+            assert(util::tile::detail::squaredSegmentDistance(pt, line[segment], line[segment + 1]) <= tolerance * tolerance);
+        }
+    }
+
+    assert(util::tile::simplifyTolerance(9) == util::tile::PIXEL);
+    assert(util::tile::simplifyTolerance(20) == 1);
 }
 
-void test1() {
-    tile_line_vector lines;
-    coordinate_line_map starts;
-    coordinate_line_map ends;
-
-    merge(makesegment(1,1,2,2), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(2,2,3,3), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(3,3,4,4), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(7,7,4,4), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(5,5,6,6), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(0,0,1,1), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(4,4,5,5), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(4,4,5,5), lines, starts, ends);
-    dump(lines, starts, ends);
+void testTileCache() {
+    const auto tile = [](const std::size_t size) { return std::make_shared<const std::string>(size, 'x'); };
+
+    // One shard, so evictions are in plain LRU order
+    TileCache cache(4 * 1024, 1);
+    assert(cache.find(1, 2, 3) == nullptr);
+    cache.insert(1, 2, 3, 0, tile(100));
+    assert(cache.find(1, 2, 3) != nullptr && cache.find(1, 2, 3)->size() == 100);
+    assert(cache.find(2, 1, 3) == nullptr);
+
+    // A newer tile replaces an older one, but a slow render doesn't replace
+    // a newer tile
+    cache.insert(1, 2, 3, 1, tile(200));
+    assert(cache.find(1, 2, 3)->size() == 200);
+    cache.insert(1, 2, 3, 2, tile(300));
+    cache.insert(1, 2, 3, 1, tile(400));
+    assert(cache.find(1, 2, 3)->size() == 300);
+
+    // The least recently used tiles make way for new ones.  With the 128
+    // bytes charged for bookkeeping, four of these fill the cache.
+    for (int x = 0; x < 8; ++x) cache.insert(x, 0, 10, 2, tile(1024 - 128));
+    assert(cache.find(0, 0, 10) == nullptr);
+    assert(cache.find(7, 0, 10) != nullptr);
+
+    cache.erase(7, 0, 10);
+    assert(cache.find(7, 0, 10) == nullptr);
+
+    const auto stats = cache.stats();
+    assert(stats.invalidations == 1);
+    assert(stats.bytes <= stats.capacity);
+    assert(stats.entries == 3);
+    assert(stats.evictions == 5);
+    assert(stats.hits == 5);
 }
 
-void test2() {
-    tile_line_vector lines;
-    coordinate_line_map starts;
-    coordinate_line_map ends;
+void testPendingBlocks() {
+    PendingBlocks<int> pending;
+    const PendingBlocks<int>::key_t block{2, 4, 3, 7};
+
+    // Only the first request for a block renders it, and everyone waiting
+    // for it gets the result
+    assert(pending.join(block, 1));
+    assert(!pending.join(block, 2));
+    assert(!pending.join(block, 3));
+    // ...but not a request for the block from another generation
+    assert(pending.join({2, 4, 3, 8}, 4));
+    assert(pending.size() == 2);
+    assert((pending.finish(block) == std::vector<int>{1, 2, 3}));
+    assert(pending.size() == 1);
+    assert(pending.finish(block).empty());
+
+    // Once it's finished, the next request renders it again
+    assert(pending.join(block, 5));
+}
+
+void testEdgeLookup() {
+    // Runs of consecutive nodes like ways have, with some edges repeated
+    // and some long runs of one node, so matches straddle blocks
+    std::mt19937 rng(9);
+    std::vector<nodepair_t> edges;
+    std::uint64_t node = 1;
+    for (int i = 0; i < 5000; ++i) {
+        const auto previous = node;
+        node += 1 + rng() % 50;
+        if (rng() % 10 == 0) edges.emplace_back(node, previous);
+        else edges.emplace_back(previous, node);
+        if (rng() % 20 == 0) edges.push_back(edges[rng() % edges.size()]);
+        if (rng() % 100 == 0) for (int j = 0; j < 40; ++j) edges.emplace_back(node, node + 1000 + j);
+    }
+    const util::EdgeLookup lookup(edges);
+    assert(lookup.size() == edges.size());
+
+    const auto expected = [&edges](const nodepair_t &pair) {
+        std::vector<std::pair<edge_id_t, bool>> result;
+        for (edge_id_t edge = 0; edge < edges.size(); ++edge) {
+            if (edges[edge] == pair) result.emplace_back(edge, false);
+            if (edges[edge] == nodepair_t(pair.second, pair.first)) result.emplace_back(edge, true);
+        }
+        return result;
+    };
+
+    std::vector<nodepair_t> queries;
+    for (int i = 0; i < 2000; ++i) {
+        auto pair = edges[rng() % edges.size()];
+        if (i % 3 == 1) std::swap(pair.first, pair.second);
+        if (i % 3 == 2) pair.second += 1;
+        queries.push_back(pair);
+    }
+    queries.emplace_back(0, 0);
+    queries.emplace_back(node + 5000, node + 5001);
+
+    std::vector<std::vector<std::pair<edge_id_t, bool>>> batched(queries.size());
+    lookup.forEachBatch(queries.data(), queries.size(), [&batched](const std::size_t i, const edge_id_t edge, const bool reversed) {
+        batched[i].emplace_back(edge, reversed);
+    });
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        std::vector<std::pair<edge_id_t, bool>> found;
+        lookup.forEach(queries[i].first, queries[i].second, [&found](const edge_id_t edge, const bool reversed) {
+            found.emplace_back(edge, reversed);
+        });
+        std::sort(found.begin(), found.end());
+        assert(found == expected(queries[i]));
+        std::sort(batched[i].begin(), batched[i].end());
+        assert(batched[i] == found);
+    }
+
+    // Well under the 24 bytes of a plain (node, node, edge) array
+    assert(lookup.memory() < edges.size() * 8);
+}
+
+void testSpeedFile() {
+    util::speeds::detail::row_t row;
+    const auto parse = [&row](const std::string &line) { return util::speeds::detail::parseRow(line.data(), line.data() + line.size(), row); };
+    assert(parse("12,34,56") && row.from == 12 && row.to == 34 && row.speed == 56);
+    assert(parse("12,34,56.5,extra\r") && row.speed == 57);
+    assert(parse("12,34,300") && row.speed == util::speeds::MAX_SPEED);
+    assert(!parse("from,to,speed"));
+    assert(!parse("12,34"));
+    assert(!parse("12,34,5x"));
+
+    // Edges 1 and 3 overlap, and 2 runs backwards
+    const std::vector<nodepair_t> edges{{1, 2}, {2, 3}, {5, 4}, {1, 2}};
+    const util::EdgeLookup lookup(edges);
+
+    char path[] = "/tmp/speedsXXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd != -1);
+    const std::string csv = "from,to,speed\n"
+                            "1,2,10\n"
+                            "2,1,20\n"
+                            "\n"
+                            "3,2,30\n"
+                            "4,5,40\r\n"
+                            "7,8,50\n"
+                            "2,3,60\n"
+                            "2,3,70";
+    assert(write(fd, csv.data(), csv.size()) == static_cast<ssize_t>(csv.size()));
+    close(fd);
+
+    // Tiny blocks, so rows are spread over several rounds of threads
+    util::speeds::SpeedTable table(edges.size());
+    const auto stats = util::speeds::loadSpeedFile(path, lookup, table, 3, 8);
+    unlink(path);
+
+    assert(stats.rows == 7 && stats.malformed == 1 && stats.unmatched == 1 && stats.updates == 8);
+    assert(table.forward[0] == 10 && table.reverse[0] == 20);
+    assert(table.forward[3] == 10 && table.reverse[3] == 20);
+    // The last of several rows for an edge wins
+    assert(table.forward[1] == 70 && table.reverse[1] == 30);
+    assert(table.forward[2] == util::speeds::NO_SPEED && table.reverse[2] == 40);
+}
+
+void testSpeedStore() {
+    using util::speeds::update_t;
+    util::speeds::SpeedTable initial(4);
+    initial.set(0, false, 10);
+    util::speeds::SpeedStore store(initial);
+
+    {
+        const auto first = store.snapshot();
+        assert(first.generation() == 0 && first.table().forward[0] == 10);
+        assert(store.apply({{1, false, 20}, {1, true, 21}}) == 1);
+        // Old snapshots don't change
+        assert(first.table().forward[1] == util::speeds::NO_SPEED);
+    }
+    {
+        const auto second = store.snapshot();
+        assert(second.generation() == 1 && second.table().forward[1] == 20 && second.table().reverse[1] == 21);
+    }
+    // Each copy catches up on the update it missed
+    assert(store.apply({{2, false, 30}}) == 2);
+    assert(store.apply({{3, false, 40}}) == 3);
+    {
+        const auto latest = store.snapshot();
+        assert(latest.generation() == 3);
+        const auto &forward = latest.table().forward;
+        assert(forward[0] == 10 && forward[1] == 20 && forward[2] == 30 && forward[3] == 40);
+    }
+
+    // Every snapshot sees one whole update, never part of one
+    util::speeds::SpeedStore racing(util::speeds::SpeedTable(1000));
+    std::thread writer([&racing]() {
+        std::vector<update_t> updates;
+        for (int generation = 1; generation <= 200; ++generation) {
+            updates.clear();
+            for (edge_id_t edge = 0; edge < 1000; ++edge) updates.push_back({edge, false, static_cast<util::speeds::speed_t>(generation)});
+            racing.apply(updates);
+        }
+    });
+    for (std::uint64_t seen = 0; seen < 200;) {
+        const auto snapshot = racing.snapshot();
+        const auto &forward = snapshot.table().forward;
+        const auto expected = snapshot.generation() == 0 ? util::speeds::NO_SPEED : snapshot.generation();
+        for (const auto speed : forward) assert(speed == expected);
+        seen = snapshot.generation();
+    }
+    writer.join();
+}
 
-    merge(makesegment(1,0,2,0), lines, starts, ends);
-    dump(lines, starts, ends);
-    merge(makesegment(2,0,3,0), lines, starts, ends);
-    dump(lines, starts, ends);
+void testSpeedBins() {
+    const auto bins = util::speeds::SpeedBins::defaults();
+    assert(bins.size() == 5 && bins.name(0) == "unknown" && bins.name(1) == "uncongested");
+    assert(bins.bin(100, 100) == 1 && bins.bin(100, 120) == 1 && bins.bin(100, 75) == 1);
+    assert(bins.bin(100, 74) == 2 && bins.bin(100, 30) == 3 && bins.bin(100, 0) == 4);
+    assert(bins.bin(util::speeds::NO_SPEED, 50) == util::speeds::SpeedBins::UNKNOWN);
+    assert(bins.bin(50, util::speeds::NO_SPEED) == util::speeds::SpeedBins::UNKNOWN);
+    assert(bins.bin(0, 0) == util::speeds::SpeedBins::UNKNOWN);
 
-    merge(makesegment(3,1,2,1), lines, starts, ends);
-    dump(lines, starts, ends);
+    // An edge takes the more congested of its directions
+    util::speeds::SpeedTable freeflow(1), current(1);
+    freeflow.set(0, false, 100);
+    freeflow.set(0, true, 100);
+    current.set(0, false, 90);
+    assert(bins.edgeBin(freeflow, current, 0) == 1);
+    current.set(0, true, 10);
+    assert(bins.edgeBin(freeflow, current, 0) == 4);
+}
+
+void testDirtyTiles() {
+    const auto key = [](std::uint64_t x, std::uint64_t y) { return x << 32 | y; };
+    // World units per tile at z10
+    const std::uint32_t size = 1u << 22;
+
+    // The middle of a z10 tile is on just that tile, from z10 down, and on
+    // nothing above its minzoom
+    util::tile::DirtyTiles tiles;
+    const world_point_t a(100 * size + size / 2, 200 * size + size / 2);
+    const world_point_t b(100 * size + size / 2 + 10, 200 * size + size / 2 + 10);
+    tiles.addSegment(a, b, 10);
+    tiles.finish();
+    assert(tiles.tiles(9).empty());
+    assert(tiles.tiles(10) == std::vector<std::uint64_t>{key(100, 200)});
+    // ...where it's on the corner of four tiles
+    assert((tiles.tiles(11) == std::vector<std::uint64_t>{key(200, 400), key(200, 401), key(201, 400), key(201, 401)}));
+
+    // Near the edge, it's in the buffer of the next tile too
+    util::tile::DirtyTiles edge;
+    edge.addSegment(world_point_t(101 * size - 10, 200 * size + size / 2), world_point_t(101 * size - 20, 200 * size + size / 2), 10);
+    edge.finish();
+    assert((edge.tiles(10) == std::vector<std::uint64_t>{key(100, 200), key(101, 200)}));
+
+    // A long diagonal marks a band of tiles, not its whole bounding box
+    util::tile::DirtyTiles diagonal;
+    diagonal.addSegment(world_point_t(0, 0), world_point_t(100 * size, 100 * size), 10);
+    diagonal.finish();
+    const auto &band = diagonal.tiles(10);
+    assert(band.size() >= 100 && band.size() < 400);
+    for (std::uint64_t i = 0; i < 100; ++i) assert(std::binary_search(band.begin(), band.end(), key(i, i)));
+
+    // Updates since a generation, while they fit in the log's budget
+    util::tile::DirtyLog log(tiles.memory() + edge.memory() + 2 * diagonal.memory() - 1);
+    log.add(1, std::make_shared<const util::tile::DirtyTiles>(tiles));
+    log.add(2, std::make_shared<const util::tile::DirtyTiles>(edge));
+    std::size_t seen = 0;
+    std::uint64_t latest = 0;
+    assert(log.since(0, latest, [&seen](const util::tile::DirtyTiles &) { ++seen; }) && seen == 2 && latest == 2);
+    seen = 0;
+    assert(log.since(1, latest, [&seen](const util::tile::DirtyTiles &) { ++seen; }) && seen == 1);
+    log.add(3, std::make_shared<const util::tile::DirtyTiles>(diagonal));
+    assert(log.since(0, latest, [](const util::tile::DirtyTiles &) {}) && latest == 3);
+    assert(log.memory() == tiles.memory() + edge.memory() + diagonal.memory());
+    // The oldest are forgotten to make room, but the latest is always kept
+    log.add(4, std::make_shared<const util::tile::DirtyTiles>(diagonal));
+    assert(!log.since(0, latest, [](const util::tile::DirtyTiles &) {}));
+    assert(log.since(1, latest, [](const util::tile::DirtyTiles &) {}) && latest == 4);
+    util::tile::DirtyLog tiny(1);
+    tiny.add(1, std::make_shared<const util::tile::DirtyTiles>(diagonal));
+    assert(tiny.since(0, latest, [](const util::tile::DirtyTiles &) {}) && latest == 1);
+}
+
+void testSnapshot() {
+    std::mt19937 rng(11);
+    auto chunks = randomChunks(rng, 1000);
+    util::ZoomIndex index;
+    index.build(chunks, chunk_minzoom(), chunk_indexable());
+    std::vector<nodepair_t> edges;
+    for (std::uint64_t i = 0; i < 1000; ++i) edges.emplace_back(rng() % 100000, rng() % 100000);
+    const util::EdgeLookup lookup(edges);
+
+    char path[] = "/tmp/snapshotXXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    {
+        util::snapshot::Writer writer(path);
+        writer.add("chunks", chunks);
+        index.save(writer, "index");
+        lookup.save(writer, "edges");
+        writer.commit();
+    }
+    assert(util::snapshot::Reader::isSnapshot(path));
+
+    {
+        const util::snapshot::Reader reader(path);
+        const auto mapped_chunks = reader.array<chunk_t>("chunks");
+        assert(mapped_chunks.size() == chunks.size());
+        assert(std::memcmp(mapped_chunks.data(), chunks.data(), chunks.size() * sizeof(chunk_t)) == 0);
+
+        // The mapped index and lookup answer just like the ones they were saved from
+        util::ZoomIndex mapped_index;
+        mapped_index.load(reader, "index");
+        assert(mapped_index.size() == index.size() && mapped_index.numBands() == index.numBands());
+        std::vector<util::PackedIndex::range_t> ranges, mapped_ranges;
+        std::vector<std::uint32_t> stack;
+        for (int q = 0; q < 100; ++q) {
+            const int z = 4 + q % 13;
+            const auto box = util::tile::searchBox(rng() % (1 << z), rng() % (1 << z), z);
+            ranges.clear();
+            mapped_ranges.clear();
+            index.query(box, z, ranges, stack);
+            mapped_index.query(box, z, mapped_ranges, stack);
+            assert(ranges == mapped_ranges);
+        }
+
+        util::EdgeLookup mapped_lookup;
+        mapped_lookup.load(reader, "edges");
+        assert(mapped_lookup.size() == lookup.size());
+        for (const auto &edge : edges) {
+            std::vector<std::pair<edge_id_t, bool>> expected, found;
+            lookup.forEach(edge.first, edge.second, [&expected](const edge_id_t id, const bool reversed) { expected.emplace_back(id, reversed); });
+            mapped_lookup.forEach(edge.first, edge.second, [&found](const edge_id_t id, const bool reversed) { found.emplace_back(id, reversed); });
+            assert(!expected.empty() && found == expected);
+        }
+
+        bool threw = false;
+        try { reader.array<std::uint64_t>("chunks"); } catch (const std::runtime_error &) { threw = true; }
+        assert(threw);
+    }
+
+    // A flipped byte anywhere is caught before anything is used
+    {
+        std::FILE *file = std::fopen(path, "r+b");
+        std::fseek(file, 200, SEEK_SET);
+        const int byte = std::fgetc(file);
+        std::fseek(file, 200, SEEK_SET);
+        std::fputc(byte ^ 1, file);
+        std::fclose(file);
+    }
+    bool threw = false;
+    try { util::snapshot::Reader reader(path); } catch (const std::runtime_error &) { threw = true; }
+    assert(threw);
+    unlink(path);
+}
+
+void testParallel() {
+    std::vector<int> hits(1000, 0);
+    util::parallelFor(hits.size(), 3, [&hits](const std::size_t first, const std::size_t last) {
+        assert(first % 64 == 0);
+        for (auto i = first; i < last; ++i) ++hits[i];
+    }, 64);
+    assert(std::all_of(hits.begin(), hits.end(), [](const int hit) { return hit == 1; }));
+
+    // Equal keys keep their order, just like std::stable_sort, with any
+    // number of threads
+    std::mt19937 rng(13);
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> items(200000);
+    for (std::uint32_t i = 0; i < items.size(); ++i) items[i] = {rng() % 100, i};
+    const auto by_key = [](const std::pair<std::uint32_t, std::uint32_t> &a, const std::pair<std::uint32_t, std::uint32_t> &b) { return a.first < b.first; };
+    auto expected = items;
+    std::stable_sort(expected.begin(), expected.end(), by_key);
+    for (std::size_t threads = 1; threads <= 5; ++threads) {
+        auto sorted = items;
+        util::parallelStableSort(sorted.begin(), sorted.end(), by_key, threads);
+        assert(sorted == expected);
+    }
+
+    // The index and the edge lookup come out the same on any number of threads
+    auto chunks = randomChunks(rng, 100000);
+    std::vector<nodepair_t> edges;
+    for (std::size_t i = 0; i < chunks.size(); ++i) edges.emplace_back(rng() % 1000000, rng() % 1000000);
+    auto serial_chunks = chunks;
+    util::ZoomIndex serial_index, parallel_index;
+    serial_index.build(serial_chunks, chunk_minzoom(), chunk_indexable());
+    parallel_index.build(chunks, chunk_minzoom(), chunk_indexable(), 4);
+    assert(std::memcmp(chunks.data(), serial_chunks.data(), chunks.size() * sizeof(chunk_t)) == 0);
+    assert(parallel_index.memory() == serial_index.memory());
+    std::vector<util::PackedIndex::range_t> serial_ranges, parallel_ranges;
+    std::vector<std::uint32_t> stack;
+    for (int q = 0; q < 100; ++q) {
+        const int z = 4 + q % 13;
+        const auto box = util::tile::searchBox(rng() % (1 << z), rng() % (1 << z), z);
+        serial_ranges.clear();
+        parallel_ranges.clear();
+        serial_index.query(box, z, serial_ranges, stack);
+        parallel_index.query(box, z, parallel_ranges, stack);
+        assert(serial_ranges == parallel_ranges);
+    }
+
+    const util::EdgeLookup serial_lookup(edges);
+    const util::EdgeLookup parallel_lookup(edges, 4);
+    assert(parallel_lookup.memory() == serial_lookup.memory());
+    for (std::size_t i = 0; i < edges.size(); i += 7) {
+        std::vector<std::pair<edge_id_t, bool>> serial_found, parallel_found;
+        serial_lookup.forEach(edges[i].first, edges[i].second, [&](const edge_id_t edge, const bool reversed) { serial_found.emplace_back(edge, reversed); });
+        parallel_lookup.forEach(edges[i].first, edges[i].second, [&](const edge_id_t edge, const bool reversed) { parallel_found.emplace_back(edge, reversed); });
+        assert(!serial_found.empty() && serial_found == parallel_found);
+    }
+}
+
+void testNodeLocations() {
+    // Ids bunched together in places and spread out in others, over many pages
+    std::mt19937 rng(17);
+    std::vector<std::uint64_t> ids;
+    for (std::uint64_t id = 1; id < 5000000; id += 1 + (rng() % 4 == 0 ? rng() % 100000 : rng() % 3)) ids.push_back(id);
+    util::NodeIdSet set;
+    for (auto i = ids.size(); i > 0; --i) set.add(ids[i - 1]);
+    set.finish();
+    assert(set.size() == ids.size());
+    for (std::size_t i = 0; i < ids.size(); i += 13) {
+        assert(set.contains(ids[i]) && set.rank(ids[i]) == i);
+        assert(!set.contains(ids[i] + 1) || (i + 1 < ids.size() && ids[i + 1] == ids[i] + 1));
+    }
+    assert(set.rank(ids.back() + 1) == ids.size() && set.rank(100000000) == ids.size());
+
+    // Every other node in the set turns up, along with some that aren't
+    util::NodeLocations locations(set);
+    const auto x_of = [](const std::uint64_t id) { return static_cast<std::int32_t>(100000000 + (id % 1000) * 37 - static_cast<std::int64_t>(id / 3)); };
+    const auto y_of = [](const std::uint64_t id) { return static_cast<std::int32_t>(-500000000 + static_cast<std::int64_t>(id) * 11); };
+    for (std::uint64_t id = 1; id < ids.back() + 10; ++id) {
+        if (!set.contains(id) || set.rank(id) % 2 == 0) locations.add(id, x_of(id), y_of(id));
+    }
+    locations.finish();
+    std::int32_t x, y;
+    for (std::size_t i = 0; i < ids.size(); i += 7) {
+        assert(locations.get(ids[i], x, y));
+        if (i % 2 == 0) assert(x == x_of(ids[i]) && y == y_of(ids[i]));
+        else assert(x == util::NodeLocations::MISSING && y == util::NodeLocations::MISSING);
+    }
+    assert(!locations.get(ids.back() + 5, x, y));
+
+    bool threw = false;
+    try { locations.add(ids[0], 0, 0); } catch (const std::runtime_error &) { threw = true; }
+    assert(threw);
+}
+
+void testRoadClasses() {
+    const auto classes = util::RoadClasses::defaults();
+    assert(classes.size() == 14);
+    const auto motorway = classes.find("motorway");
+    assert(motorway != util::RoadClasses::NONE && classes[motorway].minzoom == 4 && classes[motorway].directions == Forward);
+    assert(classes[classes.find("unclassified")].minzoom == 16 && classes[classes.find("unclassified")].directions == Both);
+    for (const char *name : {"motorway_", "motorwa", "footway", "", "Motorway", "ferry"}) assert(classes.find(name) == util::RoadClasses::NONE);
+
+    // Every one of many classes gets a slot of its own
+    std::vector<util::road_class_t> many;
+    for (int i = 0; i < 200; ++i) many.push_back({"class" + std::to_string(i), static_cast<std::uint8_t>(i % 23), Both});
+    const util::RoadClasses lots(many);
+    for (int i = 0; i < 200; ++i) assert(lots.find(("class" + std::to_string(i)).c_str()) == i);
+    assert(lots.find("class200") == util::RoadClasses::NONE);
+
+    bool threw = false;
+    try { util::RoadClasses({{"trunk", 9, Both}, {"trunk", 10, Both}}); } catch (const std::invalid_argument &) { threw = true; }
+    assert(threw);
+}
 
-    merge(makesegment(2,1,1,1), lines, starts, ends);
-    dump(lines, starts, ends);
+void testConfig() {
+    const auto config = util::config::Config::parse("# roads only\n"
+                                                    "roads:\n"
+                                                    "  footway:   # paths\n"
+                                                    "    minzoom: 17\n"
+                                                    "  \"busway\":\n"
+                                                    "    minzoom: 12\n"
+                                                    "    oneway: -1\n"
+                                                    "\n"
+                                                    "speed_bins:\n"
+                                                    "  moving: 0.5\n"
+                                                    "  jammed: 0\n",
+                                                    "test.yaml");
+    assert(config.road_classes.size() == 2 && config.road_classes.find("motorway") == util::RoadClasses::NONE);
+    assert(config.road_classes[config.road_classes.find("footway")].minzoom == 17);
+    assert(config.road_classes[config.road_classes.find("busway")].directions == Reverse);
+    assert(config.speed_bins.size() == 3 && config.speed_bins.name(2) == "jammed");
 
-    merge(makesegment(1,1,1,0), lines, starts, ends);
-    dump(lines, starts, ends);
+    // Anything left out keeps its defaults
+    const auto defaults = util::config::Config::parse("", "empty.yaml");
+    assert(defaults.road_classes.size() == 14 && defaults.speed_bins.size() == 5 && defaults.metatile_size == 2);
+    assert(util::config::Config::parse("metatile_size: 8 # the most\n", "size.yaml").metatile_size == 8);
 
-    merge(makesegment(3,0,3,1), lines, starts, ends);
-    dump(lines, starts, ends);
+    const auto error = [](const std::string &text) {
+        try { util::config::Config::parse(text, "bad.yaml"); } catch (const std::runtime_error &e) { return std::string(e.what()); }
+        return std::string();
+    };
+    assert(error("roads:\n  trunk:\n    minzoom: 23\n").find("bad.yaml:3:") == 0);
+    assert(error("roads:\n  trunk:\n    oneway: sometimes\n").find("bad.yaml:3:") == 0);
+    assert(error("roads:\n  trunk:\n    oneway: yes\n").find("no minzoom") != std::string::npos);
+    assert(error("colours:\n  red: 1\n").find("bad.yaml:1:") == 0);
+    assert(error("speed_bins:\n  fast: 0.5\n    slow: 0\n").find("bad.yaml:3: unexpected indent") == 0);
+    assert(error("speed_bins:\n  fast: 0.5\n  fast: 0\n").find("bad.yaml:3: duplicate key") == 0);
+    assert(error("speed_bins:\n  fast: 0\n  slow: 0.5\n").find("bad.yaml: ") == 0);
+    assert(error("metatile_size: 9\n").find("bad.yaml:1:") == 0);
+    assert(error("metatile_size: 2.5\n").find("bad.yaml:1:") == 0);
+    assert(error("metatile_size: 3\n").find("bad.yaml:1: metatile_size should be 1, 2, 4 or 8") == 0);
 }
 
 int main(int argc, char* argv[])
 {
 
-    //test1();
+    test1();
     test2();
+    testMergeChain();
+    testTilePath();
+    testTileTransform();
+    testHilbert();
+    testPackedIndex();
+    testClipSegment();
+    testProjection();
+    testClipChunk();
+    testSimplify();
+    testTileCache();
+    testPendingBlocks();
+    testDirtyTiles();
+    testSnapshot();
+    testParallel();
+    testNodeLocations();
+    testRoadClasses();
+    testConfig();
+    testEdgeLookup();
+    testSpeedFile();
+    testSpeedStore();
+    testSpeedBins();
 }